@@ -0,0 +1,369 @@
+/*******************************************************************************
+***
+***     Author: Tyler Barrus
+***     email:  barrust@gmail.com
+***
+***     Version: 0.1.9
+***
+***     License: MIT 2016
+***
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "concurrent_hash_map.h"
+#include "set_hash.h"
+
+/*  Keys each shard holds before its first growth, at the least */
+#define SET_CONCURRENT_MIN_CAPACITY 64
+
+/*  Optimistic attempts a lookup makes before it waits on the shard lock */
+#define SET_CONCURRENT_READ_RETRIES 64
+
+/*  What a shard's free function does with a key: RETIRE holds it until
+    concurrent_set_reclaim, KEEP leaves it alone because another set owns it
+    (copy then hands the same pointer back) and FREE really frees it */
+#define SET_SHARD_RETIRE 0
+#define SET_SHARD_KEEP 1
+#define SET_SHARD_FREE 2
+
+/* PRIVATE FUNCTIONS */
+static uint64_t __shard_hash(void *key, void *global);
+static int __shard_equals(void *key_1, void *key_2, void *global);
+static void* __shard_copy(void *key, void *global);
+static void __shard_free(void *key, void *global);
+static concurrent_set_shard* __get_shard(ConcurrentSet *set, uint64_t hash);
+static SimpleSet* __new_table(concurrent_set_shard *shard, uint64_t capacity);
+static int __shard_init(ConcurrentSet *set, concurrent_set_shard *shard, uint64_t capacity);
+static int __shard_grow(concurrent_set_shard *shard);
+static void __shard_reclaim(concurrent_set_shard *shard);
+static void __shard_destroy(concurrent_set_shard *shard);
+static void* __grow_list(void *list, uint64_t n, uint64_t *max);
+static void __write_begin(concurrent_set_shard *shard);
+static void __write_end(concurrent_set_shard *shard);
+static void __cpu_relax(void);
+static int __shard_lookup(ConcurrentSet *set, void *key, void **data);
+
+/*******************************************************************************
+***        FUNCTIONS DEFINITIONS
+*******************************************************************************/
+
+int concurrent_set_init(ConcurrentSet *set, void *global, uint64_t init_size, uint64_t n_shards,
+        key_hash_function hash, key_equals_function equals,
+        key_copy_function copy, key_free_function free_key) {
+    uint64_t i, capacity;
+    uint32_t bits = 0;
+    if (n_shards == 0) {
+        n_shards = SET_CONCURRENT_SHARDS;
+    }
+    while (((uint64_t) 1 << bits) < n_shards) {
+        bits++;
+    }
+    n_shards = (uint64_t) 1 << bits;
+    // the shards are cache line aligned so that their locks do not share lines
+    set->shards = (concurrent_set_shard *) aligned_alloc(64, n_shards * sizeof(concurrent_set_shard));
+    if (set->shards == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    set->n_shards = n_shards;
+    set->shard_bits = bits;
+    set->global = global;
+    set->hash_function = hash;
+    set->equals_function = equals;
+    set->copy_function = copy;
+    set->free_function = free_key;
+    capacity = init_size / n_shards + 1;
+    if (capacity < SET_CONCURRENT_MIN_CAPACITY) {
+        capacity = SET_CONCURRENT_MIN_CAPACITY;
+    }
+    for (i = 0; i < n_shards; i++) {
+        if (__shard_init(set, &set->shards[i], capacity) != SET_TRUE) {
+            while (i-- > 0) {
+                __shard_destroy(&set->shards[i]);
+            }
+            free(set->shards);
+            set->shards = NULL;
+            return SET_MALLOC_ERROR;
+        }
+    }
+    return SET_TRUE;
+}
+
+int concurrent_set_destroy(ConcurrentSet *set) {
+    uint64_t i;
+    for (i = 0; i < set->n_shards; i++) {
+        __shard_destroy(&set->shards[i]);
+    }
+    free(set->shards);
+    set->shards = NULL;
+    set->n_shards = 0;
+    return SET_TRUE;
+}
+
+int concurrent_set_add(ConcurrentSet *set, void *key) {
+    return concurrent_set_add_with_data(set, key, NULL);
+}
+
+int concurrent_set_add_with_data(ConcurrentSet *set, void *key, void *data) {
+    concurrent_set_shard *shard = __get_shard(set, set->hash_function(key, set->global));
+    int res;
+    pthread_mutex_lock(&shard->lock);
+    res = __shard_grow(shard);
+    if (res == SET_TRUE) {
+        __write_begin(shard);
+        res = set_add_with_data(shard->set, key, data);
+        __write_end(shard);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return res;
+}
+
+int concurrent_set_remove(ConcurrentSet *set, void *key) {
+    concurrent_set_shard *shard = __get_shard(set, set->hash_function(key, set->global));
+    int res = SET_MALLOC_ERROR;
+    pthread_mutex_lock(&shard->lock);
+    // make room to retire the key first so that removing it cannot fail halfway
+    void **keys = (void **) __grow_list(shard->retired_keys, shard->n_retired_keys, &shard->max_retired_keys);
+    if (keys != NULL) {
+        shard->retired_keys = keys;
+        __write_begin(shard);
+        res = set_remove(shard->set, key);
+        __write_end(shard);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return res;
+}
+
+int concurrent_set_contains(ConcurrentSet *set, void *key) {
+    return __shard_lookup(set, key, NULL);
+}
+
+int concurrent_set_get_data(ConcurrentSet *set, void *key, void **data) {
+    return __shard_lookup(set, key, data);
+}
+
+uint64_t concurrent_set_length(ConcurrentSet *set) {
+    uint64_t i, length = 0;
+    for (i = 0; i < set->n_shards; i++) {
+        SimpleSet *table = __atomic_load_n(&set->shards[i].set, __ATOMIC_ACQUIRE);
+        length += __atomic_load_n(&table->used_nodes, __ATOMIC_RELAXED);
+    }
+    return length;
+}
+
+int concurrent_set_reclaim(ConcurrentSet *set) {
+    uint64_t i;
+    for (i = 0; i < set->n_shards; i++) {
+        pthread_mutex_lock(&set->shards[i].lock);
+        __shard_reclaim(&set->shards[i]);
+        pthread_mutex_unlock(&set->shards[i].lock);
+    }
+    return SET_TRUE;
+}
+
+
+/*******************************************************************************
+***        PRIVATE FUNCTIONS
+*******************************************************************************/
+
+/*  The shards' tables are given these in place of the user's functions, with
+    the shard as their global */
+static uint64_t __shard_hash(void *key, void *global) {
+    ConcurrentSet *set = (ConcurrentSet *) ((concurrent_set_shard *) global)->owner;
+    return set->hash_function(key, set->global);
+}
+
+static int __shard_equals(void *key_1, void *key_2, void *global) {
+    ConcurrentSet *set = (ConcurrentSet *) ((concurrent_set_shard *) global)->owner;
+    // an optimistic reader can catch a slot that is being emptied
+    if (key_1 == NULL || key_2 == NULL) {
+        return 0;
+    }
+    return set->equals_function(key_1, key_2, set->global);
+}
+
+static void* __shard_copy(void *key, void *global) {
+    concurrent_set_shard *shard = (concurrent_set_shard *) global;
+    ConcurrentSet *set = (ConcurrentSet *) shard->owner;
+    if (shard->key_mode == SET_SHARD_KEEP) {
+        return key;
+    }
+    return set->copy_function(key, set->global);
+}
+
+static void __shard_free(void *key, void *global) {
+    concurrent_set_shard *shard = (concurrent_set_shard *) global;
+    ConcurrentSet *set = (ConcurrentSet *) shard->owner;
+    if (shard->key_mode == SET_SHARD_FREE) {
+        set->free_function(key, set->global);
+    } else if (shard->key_mode == SET_SHARD_RETIRE) {
+        // concurrent_set_remove made room for it
+        shard->retired_keys[shard->n_retired_keys++] = key;
+    }
+}
+
+/*  The shards' tables take their tags from the top bits of the hash and
+    their home slots from its low bits, so the shard comes from the top bits
+    of the hash remixed; picking it from the raw bits would leave every key
+    of a shard sharing its tag bits */
+static concurrent_set_shard* __get_shard(ConcurrentSet *set, uint64_t hash) {
+    if (set->shard_bits == 0) {
+        return &set->shards[0];
+    }
+    return &set->shards[set_hash_murmur3(hash) >> (64 - set->shard_bits)];
+}
+
+static SimpleSet* __new_table(concurrent_set_shard *shard, uint64_t capacity) {
+    SimpleSet *table = (SimpleSet *) malloc(sizeof(SimpleSet));
+    if (table == NULL) {
+        return NULL;
+    }
+    // no incremental rehash: lookups must not write to the table
+    if (set_init_alt(table, shard, capacity, __shard_hash, __shard_equals, __shard_copy, __shard_free, 0) != SET_TRUE) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static int __shard_init(ConcurrentSet *set, concurrent_set_shard *shard, uint64_t capacity) {
+    memset(shard, 0, sizeof(concurrent_set_shard));
+    shard->owner = set;
+    shard->key_mode = SET_SHARD_RETIRE;
+    shard->capacity = capacity;
+    shard->set = __new_table(shard, capacity);
+    if (shard->set == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+    return SET_TRUE;
+}
+
+/*  Called with the shard locked. A set made with room for capacity keys
+    never grows in place before it holds capacity keys, so replacing it just
+    before then means readers only ever see whole tables */
+static int __shard_grow(concurrent_set_shard *shard) {
+    SimpleSet *grown;
+    int res;
+    if (shard->set->used_nodes < shard->capacity) {
+        return SET_TRUE;
+    }
+    SimpleSet **sets = (SimpleSet **) __grow_list(shard->retired_sets, shard->n_retired_sets, &shard->max_retired_sets);
+    if (sets == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    shard->retired_sets = sets;
+    grown = __new_table(shard, shard->capacity * 2);
+    if (grown == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    // the keys move over as they are; the old set keeps pointing at them
+    shard->key_mode = SET_SHARD_KEEP;
+    res = set_union_into(grown, shard->set);
+    if (res != SET_TRUE) {
+        set_destroy(grown);
+        free(grown);
+    }
+    shard->key_mode = SET_SHARD_RETIRE;
+    if (res != SET_TRUE) {
+        return res;
+    }
+    shard->retired_sets[shard->n_retired_sets++] = shard->set;
+    __atomic_store_n(&shard->set, grown, __ATOMIC_RELEASE);
+    shard->capacity *= 2;
+    return SET_TRUE;
+}
+
+static void __shard_reclaim(concurrent_set_shard *shard) {
+    ConcurrentSet *set = (ConcurrentSet *) shard->owner;
+    uint64_t i;
+    for (i = 0; i < shard->n_retired_keys; i++) {
+        set->free_function(shard->retired_keys[i], set->global);
+    }
+    shard->n_retired_keys = 0;
+    // the keys of an outgrown set live on in the set that replaced it
+    shard->key_mode = SET_SHARD_KEEP;
+    for (i = 0; i < shard->n_retired_sets; i++) {
+        set_destroy(shard->retired_sets[i]);
+        free(shard->retired_sets[i]);
+    }
+    shard->key_mode = SET_SHARD_RETIRE;
+    shard->n_retired_sets = 0;
+}
+
+static void __shard_destroy(concurrent_set_shard *shard) {
+    __shard_reclaim(shard);
+    shard->key_mode = SET_SHARD_FREE;
+    set_destroy(shard->set);
+    free(shard->set);
+    shard->set = NULL;
+    free(shard->retired_keys);
+    free(shard->retired_sets);
+    pthread_mutex_destroy(&shard->lock);
+}
+
+/*  Make room for one more pointer in list, which holds n of *max; returns
+    the (possibly moved) list or NULL if it could not grow */
+static void* __grow_list(void *list, uint64_t n, uint64_t *max) {
+    if (n < *max) {
+        return list;
+    }
+    uint64_t grown = (*max == 0) ? 16 : *max * 2;
+    void *tmp = realloc(list, grown * sizeof(void *));
+    if (tmp != NULL) {
+        *max = grown;
+    }
+    return tmp;
+}
+
+/*  seq is odd while the shard's table changes; the fence keeps the table
+    writes from being seen before the odd seq */
+static void __write_begin(concurrent_set_shard *shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void __write_end(concurrent_set_shard *shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void __cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/*  Look key up without the lock and keep the answer only if no writer
+    touched the shard meanwhile. Anything a racing writer frees stays
+    allocated until reclaim, so a torn read can only give a wrong answer,
+    which the seq check throws away */
+static int __shard_lookup(ConcurrentSet *set, void *key, void **data) {
+    uint64_t seq, hash = set->hash_function(key, set->global);
+    concurrent_set_shard *shard = __get_shard(set, hash);
+    void *found = NULL;
+    int res, tries;
+    for (tries = 0; tries < SET_CONCURRENT_READ_RETRIES; tries++) {
+        seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            __cpu_relax();
+            continue;
+        }
+        SimpleSet *table = __atomic_load_n(&shard->set, __ATOMIC_ACQUIRE);
+        res = set_get_data_hash(table, key, hash, &found);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == seq) {
+            if (res == SET_TRUE && data != NULL) {
+                *data = found;
+            }
+            return res;
+        }
+    }
+    // writers keep changing the shard; wait for them instead
+    pthread_mutex_lock(&shard->lock);
+    res = set_get_data_hash(shard->set, key, hash, &found);
+    pthread_mutex_unlock(&shard->lock);
+    if (res == SET_TRUE && data != NULL) {
+        *data = found;
+    }
+    return res;
+}
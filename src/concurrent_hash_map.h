@@ -0,0 +1,111 @@
+/*******************************************************************************
+***
+***     Author: Tyler Barrus
+***     email:  barrust@gmail.com
+***
+***     Version: 0.1.9
+***     Purpose: A hash_map that many threads can use at once
+***
+***     License: MIT 2016
+***
+***     URL: https://github.com/barrust/set
+***
+***     Usage:
+***         ConcurrentSet set;
+***         concurrent_set_init(&set, NULL, 1000000, 0, hash, equals, copy, free);
+***         // from any number of threads
+***         concurrent_set_add(&set, key);
+***         concurrent_set_contains(&set, key);
+***         // once no thread is using the set
+***         concurrent_set_destroy(&set);
+***
+*******************************************************************************/
+
+#ifndef CONCURRENT_HASH_MAP_H__
+#define CONCURRENT_HASH_MAP_H__
+
+#include <pthread.h>
+#include "hash_map.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shards used when concurrent_set_init is given 0 */
+#define SET_CONCURRENT_SHARDS 64
+
+/*  One independently locked part of a ConcurrentSet. Writers hold lock and
+    make seq odd while they change set in place; readers take no lock, they
+    retry a lookup if seq was odd or changed under them. A shard never grows
+    in place: once set holds capacity keys the writer builds a set twice the
+    size and swaps the pointer, so readers still in the old set are never
+    left with a half-moved table. Removed keys and outgrown sets may still be
+    in use by a reader and are kept on the retired lists until
+    concurrent_set_reclaim */
+typedef struct  {
+    pthread_mutex_t lock;
+    uint64_t seq;
+    SimpleSet *set;
+    uint64_t capacity;
+    int key_mode;
+    void **retired_keys;
+    uint64_t n_retired_keys;
+    uint64_t max_retired_keys;
+    SimpleSet **retired_sets;
+    uint64_t n_retired_sets;
+    uint64_t max_retired_sets;
+    void *owner;
+} __attribute__((aligned(64))) ConcurrentSetShard, concurrent_set_shard;
+
+/*  The shard of a key is picked by the top shard_bits bits of its hash
+    remixed with set_hash_murmur3, so it is independent of the tag and home
+    slot the shard's table takes from the hash itself */
+typedef struct  {
+    concurrent_set_shard *shards;
+    uint64_t n_shards;
+    uint32_t shard_bits;
+    void *global;
+    key_hash_function hash_function;
+    key_equals_function equals_function;
+    key_copy_function copy_function;
+    key_free_function free_function;
+} ConcurrentSet, concurrent_set;
+
+/*  Initialize the set with n_shards shards (rounded up to a power of two, 0
+    for SET_CONCURRENT_SHARDS) holding init_size keys between them before
+    any shard grows. The functions are used as with set_init */
+int concurrent_set_init(ConcurrentSet *set, void *global, uint64_t init_size, uint64_t n_shards,
+        key_hash_function hash, key_equals_function equals,
+        key_copy_function copy, key_free_function free);
+
+/*  Free all memory of the set, including everything retired; no thread may
+    be using the set */
+int concurrent_set_destroy(ConcurrentSet *set);
+
+/*  Add key (and data) to the set; the same return values as set_add and
+    set_add_with_data. Safe to call from any number of threads */
+int concurrent_set_add(ConcurrentSet *set, void *key);
+int concurrent_set_add_with_data(ConcurrentSet *set, void *key, void *data);
+
+/*  Remove key from the set; SET_TRUE, SET_FALSE if it was not present or
+    SET_MALLOC_ERROR if it could not be retired. The key copy is freed by
+    concurrent_set_reclaim or concurrent_set_destroy */
+int concurrent_set_remove(ConcurrentSet *set, void *key);
+
+/*  Lookups as with set_contains and set_get_data. They do not lock unless
+    writers keep changing the key's shard while the lookup runs */
+int concurrent_set_contains(ConcurrentSet *set, void *key);
+int concurrent_set_get_data(ConcurrentSet *set, void *key, void **data);
+
+/*  Number of keys in the set; only exact while no thread is writing */
+uint64_t concurrent_set_length(ConcurrentSet *set);
+
+/*  Free the removed keys and outgrown tables held for readers. Writers may
+    keep running, but no thread may be in a lookup */
+int concurrent_set_reclaim(ConcurrentSet *set);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif /* END CONCURRENT_HASH_MAP_H__ */
@@ -12,18 +12,124 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "hash_map.h"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #define MAX_FULLNESS_PERCENT 0.75       /* arbitrary */
 
+/*  Control bytes are scanned SET_GROUP_WIDTH at a time; the first
+    SET_GROUP_WIDTH control bytes are mirrored after the end of the table so
+    that a group never needs to wrap */
+#if defined(__AVX2__)
+#define SET_GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#define SET_GROUP_WIDTH 16
+#else
+#define SET_GROUP_WIDTH 8
+#endif
+#define SET_CTRL_EMPTY 0
+#define SET_CTRL_MOVED 1        /* slot of the old table already migrated */
+
+/*  Number of old slots migrated by each insert or lookup while an
+    incremental rehash is in progress; anything of at least 2 finishes the
+    migration before the new table needs to grow again */
+#define SET_REHASH_BUCKETS 8
+
+/*  set_add_batch hashes SET_BATCH_SIZE keys at a time and prefetches the home
+    slot of the key SET_PREFETCH_DISTANCE ahead of the one being inserted */
+#define SET_BATCH_SIZE 256
+#define SET_PREFETCH_DISTANCE 8
+
+/*  Size of each arena chunk; a chunk always fits at least one key */
+#define SET_ARENA_CHUNK_SIZE 65536
+
+/*  The parallel set algebra gives each thread at least this many slots;
+    smaller sets use fewer threads than asked for */
+#define SET_PARALLEL_MIN_SLOTS 65536
+
+/*  What a parallel worker records for the keys of set it walks: the slot
+    in set of those found in other, of those missing from other, the slot
+    in other of those found there, or every slot of set (other is unused) */
+#define SET_PART_FOUND 0
+#define SET_PART_MISSING 1
+#define SET_PART_MATCH 2
+#define SET_PART_ALL 3
+
+/*  One thread's share of a parallel walk: the slots [start, end) of set,
+    probed against other. The slots recorded go in indices, unless stop is
+    set, in which case the first one found raises *stop for every worker.
+    If res is set the worker also copies the recorded keys for res and
+    hashes them with res's hash; copies are owned by the part until
+    __add_parts places them (n_copies drops to 0). */
+typedef struct {
+    SimpleSet *set;
+    SimpleSet *other;
+    uint64_t start;
+    uint64_t end;
+    int mode;
+    int *stop;
+    uint64_t *indices;
+    uint64_t n_indices;
+    uint64_t max_indices;
+    SimpleSet *res;
+    void **copies;
+    uint64_t *hashes;
+    uint64_t n_copies;
+    int error;
+    pthread_t thread;
+    int started;
+} simple_set_part;
+
 /* PRIVATE FUNCTIONS */
 static int __get_index(SimpleSet *set, void *key, uint64_t hash, uint64_t *index);
-static int __assign_node(SimpleSet *set, void *key, uint64_t index, void *data);
+static int __get_old_index(SimpleSet *set, void *key, uint64_t hash, uint64_t *index);
+static int __find_index(SimpleSet *set, simple_set_node *nodes, uint8_t *ctrl, uint64_t number_nodes,
+        void *key, uint64_t hash, uint64_t *index);
+static uint64_t __get_insert_index(SimpleSet *set, uint64_t hash);
+static uint8_t __hash_tag(uint64_t hash);
+static uint64_t __mix_hash(uint64_t hash);
+static uint64_t __home_index(SimpleSet *set, uint64_t hash, uint64_t number_nodes);
+static uint64_t __round_up_pow2(uint64_t num);
+static uint32_t __match_group(const uint8_t *ctrl, uint8_t tag);
+static void __set_ctrl(SimpleSet *set, uint64_t index, uint8_t tag);
+static void __set_ctrl_in(uint8_t *ctrl, uint64_t number_nodes, uint64_t index, uint8_t tag);
+static uint64_t __ctrl_bytes(uint64_t num_els);
+static uint64_t* __occupied(SimpleSet *set);
+static uint64_t __next_occupied(SimpleSet *set, uint64_t from);
+static int __assign_node(SimpleSet *set, void *key, uint64_t hash, uint64_t index, void *data);
+static void __place_copy(SimpleSet *set, void *copy, uint64_t hash, uint64_t index, void *data);
+static void __insert_node(SimpleSet *set, simple_set_node node, uint8_t tag, uint64_t index);
 static void __free_index(SimpleSet *set, uint64_t index);
+static void __remove_where(SimpleSet *set, SimpleSet *other, int in_other);
+static void* __part_worker(void *arg);
+static void __copy_part(simple_set_part *part);
+static simple_set_part* __run_parts(SimpleSet *set, SimpleSet *other, int mode, int *stop, SimpleSet *res, int n_threads, int *n_parts);
+static uint64_t __parts_found(simple_set_part *parts, int n_parts);
+static int __add_parts(SimpleSet *res, SimpleSet *from, simple_set_part *parts, int n_parts, uint64_t extra);
+static void __free_parts(simple_set_part *parts, int n_parts);
+static int __keep_common(SimpleSet *set, SimpleSet *other);
 static int __set_contains(SimpleSet *set, void *key, uint64_t hash);
+static uint64_t __node_hash(SimpleSet *from, uint64_t index, SimpleSet *to);
 static int __set_add(SimpleSet *set, void *key, uint64_t hash, void *data);
-static void __relayout_nodes(SimpleSet *set, uint64_t start, short end_on_null);
+static int __set_resize(SimpleSet *set, uint64_t num_els);
+static int __set_start_rehash(SimpleSet *set, uint64_t num_els);
+static int __rehash_step(SimpleSet *set, uint64_t n_buckets);
+static void __rehash_finish(SimpleSet *set);
+static int __alloc_table(SimpleSet *set, uint64_t num_els, simple_set_node **nodes, uint8_t **ctrl);
+static void __free_table(SimpleSet *set, uint64_t num_els, simple_set_node *nodes, uint8_t *ctrl);
 static void __set_clear(SimpleSet *set);
+static void __prefetch_slot(SimpleSet *set, uint64_t index);
+static int __get_data(SimpleSet *set, void *key, uint64_t hash, void **data);
+static void __lookup_many(SimpleSet *set, void **keys, uint64_t n, void **datas, int *results);
+static void* __copy_key(SimpleSet *set, void *key);
+static void __free_key(SimpleSet *set, void *key);
+static void* __arena_alloc(SimpleSet *set);
+static void __arena_release(SimpleSet *set, int keep_one);
+static uint64_t __arena_chunk_size(simple_set_arena *arena);
 
 /*******************************************************************************
 ***        FUNCTIONS DEFINITIONS
@@ -32,23 +138,60 @@ static void __set_clear(SimpleSet *set);
 int set_init(SimpleSet *set, void *global, uint64_t init_size,
         key_hash_function hash, key_equals_function equals,
         key_copy_function copy, key_free_function free) {
+    return set_init_alt(set, global, init_size, hash, equals, copy, free, 0);
+}
+
+int set_init_alt(SimpleSet *set, void *global, uint64_t init_size,
+        key_hash_function hash, key_equals_function equals,
+        key_copy_function copy, key_free_function free, int flags) {
+    return set_init_allocator(set, global, init_size, hash, equals, copy, free, flags, NULL);
+}
+
+int set_init_allocator(SimpleSet *set, void *global, uint64_t init_size,
+        key_hash_function hash, key_equals_function equals,
+        key_copy_function copy, key_free_function free, int flags,
+        const set_allocator *allocator) {
+    if (allocator == NULL) {
+        set_default_allocator(&set->allocator);
+    } else {
+        set->allocator = *allocator;
+    }
     uint64_t init_elements = init_size / MAX_FULLNESS_PERCENT;
-    set->nodes = (simple_set_node**) malloc(init_elements * sizeof(simple_set_node*));
-    if (set->nodes == NULL) {
+    if (flags & SET_POWER_OF_TWO) {
+        init_elements = __round_up_pow2(init_elements);
+    }
+    if (__alloc_table(set, init_elements, &set->nodes, &set->ctrl) != SET_TRUE) {
         return SET_MALLOC_ERROR;
     }
     set->number_nodes = init_elements;
-    uint64_t i;
-    for (i = 0; i < set->number_nodes; i++) {
-        set->nodes[i] = NULL;
-    }
+    set->old_nodes = NULL;
+    set->old_ctrl = NULL;
+    set->old_number_nodes = 0;
+    set->rehash_index = 0;
     set->used_nodes = 0;
     set->n_collisions = 0;
+    set->flags = flags;
     set->global = global;
     set->hash_function = hash;
     set->equals_function = equals;
     set->copy_function = copy;
     set->free_function = free;
+    memset(&set->arena, 0, sizeof(simple_set_arena));
+    return SET_TRUE;
+}
+
+int set_init_arena(SimpleSet *set, void *global, uint64_t init_size,
+        key_hash_function hash, key_equals_function equals,
+        uint64_t key_size, int flags) {
+    if (key_size == 0) {
+        return SET_FALSE;
+    }
+    int res = set_init_alt(set, global, init_size, hash, equals, NULL, NULL, flags);
+    if (res != SET_TRUE) {
+        return res;
+    }
+    set->arena.key_size = key_size;
+    set->arena.slot_size = (key_size + sizeof(void *) - 1) & ~(uint64_t)(sizeof(void *) - 1);
     return SET_TRUE;
 }
 
@@ -59,7 +202,8 @@ int set_clear(SimpleSet *set) {
 
 int set_destroy(SimpleSet *set) {
     __set_clear(set);
-    free(set->nodes);
+    __arena_release(set, 0);
+    __free_table(set, set->number_nodes, set->nodes, set->ctrl);
     set->number_nodes = 0;
     set->used_nodes = 0;
     set->hash_function = NULL;
@@ -76,32 +220,110 @@ int set_add_with_data(SimpleSet *set, void *key, void *data) {
     return __set_add(set, key, hash, data);
 }
 
+int set_reserve(SimpleSet *set, uint64_t n_elements) {
+    uint64_t num_els = set->number_nodes;
+    __rehash_finish(set);
+    while ((float)(set->used_nodes + n_elements) / num_els > MAX_FULLNESS_PERCENT) {
+        num_els *= 2;
+    }
+    if (num_els == set->number_nodes) {
+        return SET_TRUE;
+    }
+    return __set_resize(set, num_els);
+}
+
+int set_add_batch(SimpleSet *set, void **keys, void **datas, uint64_t n, int *results) {
+    uint64_t hashes[SET_BATCH_SIZE];
+    uint64_t start, i, m;
+    if (set_reserve(set, n) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
+    for (start = 0; start < n; start += SET_BATCH_SIZE) {
+        m = (n - start < SET_BATCH_SIZE) ? n - start : SET_BATCH_SIZE;
+        for (i = 0; i < m; i++) {
+            hashes[i] = set->hash_function(keys[start + i], set->global);
+        }
+        for (i = 0; i < m && i < SET_PREFETCH_DISTANCE; i++) {
+            __prefetch_slot(set, __home_index(set, hashes[i], set->number_nodes));
+        }
+        for (i = 0; i < m; i++) {
+            if (i + SET_PREFETCH_DISTANCE < m) {
+                __prefetch_slot(set, __home_index(set, hashes[i + SET_PREFETCH_DISTANCE], set->number_nodes));
+            }
+            int res = __set_add(set, keys[start + i], hashes[i], (datas == NULL) ? NULL : datas[start + i]);
+            if (results != NULL) {
+                results[start + i] = res;
+            }
+        }
+    }
+    return SET_TRUE;
+}
+
 int set_contains(SimpleSet *set, void *key) {
-    uint64_t index, hash = set->hash_function(key, set->global);
-    return __get_index(set, key, hash, &index);
+    uint64_t hash = set->hash_function(key, set->global);
+    __rehash_step(set, SET_REHASH_BUCKETS);
+    return __set_contains(set, key, hash);
 }
 
 int set_remove(SimpleSet *set, void *key) {
     uint64_t index, hash = set->hash_function(key, set->global);
+    __rehash_step(set, SET_REHASH_BUCKETS);
     int pos = __get_index(set, key, hash, &index);
-    if (pos != SET_TRUE) {
+    if (pos == SET_TRUE) {
+        // remove this node; the rest of the cluster is shifted back into the hole
+        __free_index(set, index);
+    } else if (__get_old_index(set, key, hash, &index) == SET_TRUE) {
+        // not migrated yet; leave a marker so the old cluster stays intact
+        __free_key(set, set->old_nodes[index]._key);
+        set->old_nodes[index]._key = NULL;
+        __set_ctrl_in(set->old_ctrl, set->old_number_nodes, index, SET_CTRL_MOVED);
+    } else {
         return pos;
     }
-    // remove this node
-    __free_index(set, index);
-    // re-layout nodes
-    __relayout_nodes(set, index, 0);
     set->used_nodes--;
     return SET_TRUE;
 }
 
 int set_get_data(SimpleSet *set, void *key, void **data) {
-    uint64_t index, hash = set->hash_function(key, set->global);
-    int result = __get_index(set, key, hash, &index);
-    if (result == SET_TRUE) {
-        *data = set->nodes[index]->_data;
-    }
-    return result;
+    uint64_t hash = set->hash_function(key, set->global);
+    __rehash_step(set, SET_REHASH_BUCKETS);
+    return __get_data(set, key, hash, data);
+}
+
+int set_contains_many(SimpleSet *set, void **keys, uint64_t n, int *results) {
+    __lookup_many(set, keys, n, NULL, results);
+    return SET_TRUE;
+}
+
+int set_get_data_many(SimpleSet *set, void **keys, uint64_t n, void **datas, int *results) {
+    __lookup_many(set, keys, n, datas, results);
+    return SET_TRUE;
+}
+
+uint64_t set_hash(SimpleSet *set, void *key) {
+    return set->hash_function(key, set->global);
+}
+
+void set_prefetch(SimpleSet *set, uint64_t hash) {
+    __prefetch_slot(set, __home_index(set, hash, set->number_nodes));
+}
+
+void set_prefetch_key(SimpleSet *set, uint64_t hash) {
+    __builtin_prefetch(set->nodes[__home_index(set, hash, set->number_nodes)]._key, 0, 1);
+}
+
+int set_contains_hash(SimpleSet *set, void *key, uint64_t hash) {
+    __rehash_step(set, SET_REHASH_BUCKETS);
+    return __set_contains(set, key, hash);
+}
+
+int set_get_data_hash(SimpleSet *set, void *key, uint64_t hash, void **data) {
+    __rehash_step(set, SET_REHASH_BUCKETS);
+    return __get_data(set, key, hash, data);
+}
+
+int set_rehash_step(SimpleSet *set, uint64_t n_buckets) {
+    return __rehash_step(set, n_buckets);
 }
 
 uint64_t set_length(SimpleSet *set) {
@@ -109,35 +331,71 @@ uint64_t set_length(SimpleSet *set) {
 }
 
 void *set_to_array(SimpleSet *set, uint64_t *size) {
+    __rehash_finish(set);
     *size = set->used_nodes;
     void** results = malloc(set->used_nodes * sizeof(void *));
     uint64_t i, j = 0;
-    for (i = 0; i < set->number_nodes; i++) {
-        if (set->nodes[i] != NULL) {
-            results[j] = set->copy_function(set->nodes[i]->_key, set->global);
-            j++;
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        if (set->arena.key_size != 0) {
+            results[j] = malloc(set->arena.key_size);
+            memcpy(results[j], set->nodes[i]._key, set->arena.key_size);
+        } else {
+            results[j] = set->copy_function(set->nodes[i]._key, set->global);
         }
+        j++;
     }
     return results;
 }
 
+void set_iter_begin(SimpleSet *set, simple_set_iterator *iter) {
+    __rehash_finish(set);
+    iter->set = set;
+    iter->index = 0;
+}
+
+int set_iter_next(simple_set_iterator *iter, void **key, void **data) {
+    SimpleSet *set = iter->set;
+    uint64_t i = __next_occupied(set, iter->index);
+    if (i == set->number_nodes) {
+        iter->index = i;
+        return SET_FALSE;
+    }
+    if (key != NULL) {
+        *key = set->nodes[i]._key;
+    }
+    if (data != NULL) {
+        *data = set->nodes[i]._data;
+    }
+    iter->index = i + 1;
+    return SET_TRUE;
+}
+
+void set_foreach(SimpleSet *set, set_visitor visitor, void *context) {
+    __rehash_finish(set);
+    uint64_t i;
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        visitor(set->nodes[i]._key, set->nodes[i]._data, context);
+    }
+}
+
 int set_union(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
+    __rehash_finish(s1);
+    __rehash_finish(s2);
+    if (set_reserve(res, s1->used_nodes + s2->used_nodes) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
     // loop over both s1 and s2 and get keys and insert them into res
     uint64_t i;
-    for (i = 0; i < s1->number_nodes; i++) {
-        if (s1->nodes[i] != NULL) {
-            uint64_t hash = res->hash_function(s1->nodes[i]->_key, res->global);
-            __set_add(res, s1->nodes[i]->_key, hash, s1->nodes[i]->_data);
-        }
+    for (i = __next_occupied(s1, 0); i < s1->number_nodes; i = __next_occupied(s1, i + 1)) {
+        uint64_t hash = __node_hash(s1, i, res);
+        __set_add(res, s1->nodes[i]._key, hash, s1->nodes[i]._data);
     }
-    for (i = 0; i < s2->number_nodes; i++) {
-        if (s2->nodes[i] != NULL) {
-            uint64_t hash = res->hash_function(s2->nodes[i]->_key, res->global);
-            __set_add(res, s2->nodes[i]->_key, hash, s2->nodes[i]->_data);
-        }
+    for (i = __next_occupied(s2, 0); i < s2->number_nodes; i = __next_occupied(s2, i + 1)) {
+        uint64_t hash = __node_hash(s2, i, res);
+        __set_add(res, s2->nodes[i]._key, hash, s2->nodes[i]._data);
     }
     return SET_TRUE;
 }
@@ -146,15 +404,29 @@ int set_intersection(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
-    // loop over both one of s1 and s2: get keys, check the other, and insert them into res if it is
-    uint64_t i;
-    for (i = 0; i < s1->number_nodes; i++) {
-        if (s1->nodes[i] != NULL) {
-            uint64_t hash = s1->hash_function(s1->nodes[i]->_key, s1->global);
-            if (__set_contains(s2, s1->nodes[i]->_key, hash) == SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, hash, s1->nodes[i]->_data);
+    __rehash_finish(s1);
+    __rehash_finish(s2);
+    uint64_t i, index;
+    if (s2->used_nodes >= s1->used_nodes) {
+        if (set_reserve(res, s1->used_nodes) != SET_TRUE) {
+            return SET_MALLOC_ERROR;
+        }
+        // loop over s1: get keys, check s2, and insert them into res if it is
+        for (i = __next_occupied(s1, 0); i < s1->number_nodes; i = __next_occupied(s1, i + 1)) {
+            if (__set_contains(s2, s1->nodes[i]._key, __node_hash(s1, i, s2)) == SET_TRUE) {
+                __set_add(res, s1->nodes[i]._key, __node_hash(s1, i, res), s1->nodes[i]._data);
             }
         }
+        return SET_TRUE;
+    }
+    if (set_reserve(res, s2->used_nodes) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
+    // s2 is smaller: loop over it instead, still taking the keys and data from s1
+    for (i = __next_occupied(s2, 0); i < s2->number_nodes; i = __next_occupied(s2, i + 1)) {
+        if (__get_index(s1, s2->nodes[i]._key, __node_hash(s2, i, s1), &index) == SET_TRUE) {
+            __set_add(res, s1->nodes[index]._key, __node_hash(s1, index, res), s1->nodes[index]._data);
+        }
     }
     return SET_TRUE;
 }
@@ -164,14 +436,15 @@ int set_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
+    __rehash_finish(s1);
+    if (set_reserve(res, s1->used_nodes) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
     // loop over s1 and keep only things not in s2
     uint64_t i;
-    for (i = 0; i < s1->number_nodes; i++) {
-        if (s1->nodes[i] != NULL) {
-            uint64_t hash = s1->hash_function(s1->nodes[i]->_key, s1->global);
-            if (__set_contains(s2, s1->nodes[i]->_key, hash) != SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, hash, s1->nodes[i]->_data);
-            }
+    for (i = __next_occupied(s1, 0); i < s1->number_nodes; i = __next_occupied(s1, i + 1)) {
+        if (__set_contains(s2, s1->nodes[i]._key, __node_hash(s1, i, s2)) != SET_TRUE) {
+            __set_add(res, s1->nodes[i]._key, __node_hash(s1, i, res), s1->nodes[i]._data);
         }
     }
     return SET_TRUE;
@@ -181,36 +454,126 @@ int set_symmetric_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
+    __rehash_finish(s1);
+    __rehash_finish(s2);
+    if (set_reserve(res, s1->used_nodes + s2->used_nodes) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
     uint64_t i;
     // loop over set 1 and add elements that are unique to set 1
-    for (i = 0; i < s1->number_nodes; i++) {
-        if (s1->nodes[i] != NULL) {
-            uint64_t hash = s1->hash_function(s1->nodes[i]->_key, s1->global);
-            if (__set_contains(s2, s1->nodes[i]->_key, hash) != SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, hash, s1->nodes[i]->_data);
-            }
+    for (i = __next_occupied(s1, 0); i < s1->number_nodes; i = __next_occupied(s1, i + 1)) {
+        if (__set_contains(s2, s1->nodes[i]._key, __node_hash(s1, i, s2)) != SET_TRUE) {
+            __set_add(res, s1->nodes[i]._key, __node_hash(s1, i, res), s1->nodes[i]._data);
         }
     }
     // loop over set 2 and add elements that are unique to set 2
-    for (i = 0; i < s2->number_nodes; i++) {
-        if (s2->nodes[i] != NULL) {
-            uint64_t hash = s2->hash_function(s2->nodes[i]->_key, s2->global);
-            if (__set_contains(s1, s2->nodes[i]->_key, hash) != SET_TRUE) {
-                __set_add(res, s2->nodes[i]->_key, hash, s2->nodes[i]->_data);
-            }
+    for (i = __next_occupied(s2, 0); i < s2->number_nodes; i = __next_occupied(s2, i + 1)) {
+        if (__set_contains(s1, s2->nodes[i]._key, __node_hash(s2, i, s1)) != SET_TRUE) {
+            __set_add(res, s2->nodes[i]._key, __node_hash(s2, i, res), s2->nodes[i]._data);
+        }
+    }
+    return SET_TRUE;
+}
+
+uint64_t set_intersection_count(SimpleSet *s1, SimpleSet *s2) {
+    SimpleSet *small = (s2->used_nodes < s1->used_nodes) ? s2 : s1;
+    SimpleSet *large = (small == s1) ? s2 : s1;
+    __rehash_finish(small);
+    uint64_t i, count = 0;
+    for (i = __next_occupied(small, 0); i < small->number_nodes; i = __next_occupied(small, i + 1)) {
+        if (__set_contains(large, small->nodes[i]._key, __node_hash(small, i, large)) == SET_TRUE) {
+            count++;
+        }
+    }
+    return count;
+}
+
+uint64_t set_union_count(SimpleSet *s1, SimpleSet *s2) {
+    return s1->used_nodes + s2->used_nodes - set_intersection_count(s1, s2);
+}
+
+uint64_t set_difference_count(SimpleSet *s1, SimpleSet *s2) {
+    return s1->used_nodes - set_intersection_count(s1, s2);
+}
+
+int set_union_into(SimpleSet *dest, SimpleSet *src) {
+    if (dest == src) {
+        return SET_TRUE;
+    }
+    __rehash_finish(src);
+    uint64_t i;
+    for (i = __next_occupied(src, 0); i < src->number_nodes; i = __next_occupied(src, i + 1)) {
+        if (__set_add(dest, src->nodes[i]._key, __node_hash(src, i, dest), src->nodes[i]._data) == SET_MALLOC_ERROR) {
+            return SET_MALLOC_ERROR;
+        }
+    }
+    return SET_TRUE;
+}
+
+int set_intersect_update(SimpleSet *dest, SimpleSet *other) {
+    if (dest == other) {
+        return SET_TRUE;
+    }
+    __rehash_finish(dest);
+    __rehash_finish(other);
+    // walk the smaller set; if other is smaller and there is no memory to do
+    // that, sweeping dest gets the same result
+    if (other->used_nodes >= dest->used_nodes || __keep_common(dest, other) != SET_TRUE) {
+        __remove_where(dest, other, SET_FALSE);
+    }
+    return SET_TRUE;
+}
+
+int set_difference_update(SimpleSet *dest, SimpleSet *other) {
+    if (dest == other) {
+        return set_clear(dest);
+    }
+    __rehash_finish(dest);
+    __rehash_finish(other);
+    if (other->used_nodes >= dest->used_nodes) {
+        __remove_where(dest, other, SET_TRUE);
+        return SET_TRUE;
+    }
+    // remove each of other's keys from dest
+    uint64_t i, index;
+    for (i = __next_occupied(other, 0); i < other->number_nodes; i = __next_occupied(other, i + 1)) {
+        if (__get_index(dest, other->nodes[i]._key, __node_hash(other, i, dest), &index) == SET_TRUE) {
+            __free_index(dest, index);
+            dest->used_nodes--;
+        }
+    }
+    return SET_TRUE;
+}
+
+int set_symmetric_difference_update(SimpleSet *dest, SimpleSet *other) {
+    if (dest == other) {
+        return set_clear(dest);
+    }
+    __rehash_finish(dest);
+    __rehash_finish(other);
+    // keys of other that dest has go, the rest come in
+    uint64_t i, index;
+    for (i = __next_occupied(other, 0); i < other->number_nodes; i = __next_occupied(other, i + 1)) {
+        uint64_t hash = __node_hash(other, i, dest);
+        if (__get_index(dest, other->nodes[i]._key, hash, &index) == SET_TRUE) {
+            __free_index(dest, index);
+            dest->used_nodes--;
+        } else if (__set_add(dest, other->nodes[i]._key, hash, other->nodes[i]._data) == SET_MALLOC_ERROR) {
+            return SET_MALLOC_ERROR;
         }
     }
     return SET_TRUE;
 }
 
 int set_is_subset(SimpleSet *test, SimpleSet *against) {
+    if (test->used_nodes > against->used_nodes) {
+        return SET_FALSE;
+    }
+    __rehash_finish(test);
     uint64_t i;
-    for (i = 0; i < test->number_nodes; i++) {
-        if (test->nodes[i] != NULL) {
-            uint64_t hash = test->hash_function(test->nodes[i]->_key, test->global);
-            if (__set_contains(against, test->nodes[i]->_key, hash) == SET_FALSE) {
-                return SET_FALSE;
-            }
+    for (i = __next_occupied(test, 0); i < test->number_nodes; i = __next_occupied(test, i + 1)) {
+        if (__set_contains(against, test->nodes[i]._key, __node_hash(test, i, against)) == SET_FALSE) {
+            return SET_FALSE;
         }
     }
     return SET_TRUE;
@@ -231,129 +594,890 @@ int set_is_superset_strict(SimpleSet *test, SimpleSet *against) {
     return set_is_subset_strict(against, test);
 }
 
+uint64_t set_probe_histogram(SimpleSet *set, uint64_t *histogram, uint64_t n_bins) {
+    __rehash_finish(set);
+    uint64_t i, max_probe = 0;
+    for (i = 0; i < n_bins; i++) {
+        histogram[i] = 0;
+    }
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        uint64_t dist = set->nodes[i]._dist;
+        if (dist > max_probe) {
+            max_probe = dist;
+        }
+        if (n_bins != 0) {
+            histogram[dist < n_bins ? dist : n_bins - 1]++;
+        }
+    }
+    return max_probe;
+}
+
 int set_cmp(SimpleSet *left, SimpleSet *right) {
     if (left->used_nodes < right->used_nodes) {
         return -1;
     } else if (right->used_nodes < left->used_nodes) {
         return 1;
     }
+    __rehash_finish(left);
     uint64_t i;
-    for (i = 0; i < left->number_nodes; i++) {
-        if (left->nodes[i] != NULL) {
-            if (set_contains(right, left->nodes[i]->_key) != SET_TRUE) {
-                return 2;
-            }
+    for (i = __next_occupied(left, 0); i < left->number_nodes; i = __next_occupied(left, i + 1)) {
+        if (__set_contains(right, left->nodes[i]._key, __node_hash(left, i, right)) != SET_TRUE) {
+            return 2;
         }
     }
 
     return 0;
 }
 
+int set_union_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, int n_threads) {
+    if (res->used_nodes != 0) {
+        return SET_OCCUPIED_ERROR;
+    }
+    __rehash_finish(s1);
+    __rehash_finish(s2);
+    // copy all of s1 and find (and copy) the keys of s2 that s1 lacks in parallel
+    int n_all, n_missing, status;
+    simple_set_part *all = __run_parts(s1, NULL, SET_PART_ALL, NULL, res, n_threads, &n_all);
+    if (all == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    simple_set_part *missing = __run_parts(s2, s1, SET_PART_MISSING, NULL, res, n_threads, &n_missing);
+    if (missing == NULL) {
+        __free_parts(all, n_all);
+        return SET_MALLOC_ERROR;
+    }
+    status = __add_parts(res, s1, all, n_all, __parts_found(missing, n_missing));
+    if (status == SET_TRUE) {
+        status = __add_parts(res, s2, missing, n_missing, 0);
+    }
+    __free_parts(all, n_all);
+    __free_parts(missing, n_missing);
+    return status;
+}
+
+int set_intersection_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, int n_threads) {
+    if (res->used_nodes != 0) {
+        return SET_OCCUPIED_ERROR;
+    }
+    __rehash_finish(s1);
+    __rehash_finish(s2);
+    // walk the smaller set; either way the slots recorded are s1's
+    int n_parts, status;
+    simple_set_part *parts;
+    if (s2->used_nodes >= s1->used_nodes) {
+        parts = __run_parts(s1, s2, SET_PART_FOUND, NULL, res, n_threads, &n_parts);
+    } else {
+        parts = __run_parts(s2, s1, SET_PART_MATCH, NULL, res, n_threads, &n_parts);
+    }
+    if (parts == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    status = __add_parts(res, s1, parts, n_parts, 0);
+    __free_parts(parts, n_parts);
+    return status;
+}
+
+int set_difference_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, int n_threads) {
+    if (res->used_nodes != 0) {
+        return SET_OCCUPIED_ERROR;
+    }
+    __rehash_finish(s1);
+    __rehash_finish(s2);
+    int n_parts, status;
+    simple_set_part *parts = __run_parts(s1, s2, SET_PART_MISSING, NULL, res, n_threads, &n_parts);
+    if (parts == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    status = __add_parts(res, s1, parts, n_parts, 0);
+    __free_parts(parts, n_parts);
+    return status;
+}
+
+int set_is_subset_parallel(SimpleSet *test, SimpleSet *against, int n_threads) {
+    if (test->used_nodes > against->used_nodes) {
+        return SET_FALSE;
+    }
+    __rehash_finish(test);
+    __rehash_finish(against);
+    // every worker stops as soon as any of them finds a key against lacks
+    int n_parts, t, stop = 0;
+    simple_set_part *parts = __run_parts(test, against, SET_PART_MISSING, &stop, NULL, n_threads, &n_parts);
+    if (parts == NULL) {
+        return set_is_subset(test, against);
+    }
+    for (t = 0; t < n_parts; t++) {
+        if (parts[t].n_indices != 0) {
+            stop = 1;
+        }
+    }
+    __free_parts(parts, n_parts);
+    return stop ? SET_FALSE : SET_TRUE;
+}
+
+int set_cmp_parallel(SimpleSet *left, SimpleSet *right, int n_threads) {
+    if (left->used_nodes < right->used_nodes) {
+        return SET_RIGHT_GREATER;
+    } else if (right->used_nodes < left->used_nodes) {
+        return SET_LEFT_GREATER;
+    }
+    return (set_is_subset_parallel(left, right, n_threads) == SET_TRUE) ? SET_EQUAL : SET_UNEQUAL;
+}
+
 
 /*******************************************************************************
 ***        PRIVATE FUNCTIONS
 *******************************************************************************/
 static int __set_contains(SimpleSet *set, void *key, uint64_t hash) {
     uint64_t index;
-    return __get_index(set, key, hash, &index);
+    int res = __get_index(set, key, hash, &index);
+    if (res != SET_TRUE && __get_old_index(set, key, hash, &index) == SET_TRUE) {
+        return SET_TRUE;
+    }
+    return res;
+}
+
+/*  The hash of a node in one set, as needed to probe another set. The hash
+    cached in the node is reused whenever both sets hash keys the same way. */
+static uint64_t __node_hash(SimpleSet *from, uint64_t index, SimpleSet *to) {
+    if (from->hash_function == to->hash_function && from->global == to->global) {
+        return from->nodes[index]._hash;
+    }
+    return to->hash_function(from->nodes[index]._key, to->global);
 }
 
 static int __set_add(SimpleSet *set, void *key, uint64_t hash, void *data) {
     uint64_t index;
+    __rehash_step(set, SET_REHASH_BUCKETS);
     if (__set_contains(set, key, hash) == SET_TRUE) {
         return SET_ALREADY_PRESENT;
     }
     // Expand nodes if we are close to our desired fullness
     if ((float)set->used_nodes / set->number_nodes > MAX_FULLNESS_PERCENT) {
-        uint64_t num_els = set->number_nodes * 2; // we want to double each time
-        simple_set_node** tmp = realloc(set->nodes, num_els * sizeof(simple_set_node*));
-        if (tmp == NULL || set->nodes == NULL) { // malloc failure
-            return SET_MALLOC_ERROR;
+        // we want to double each time
+        int res;
+        if (set->flags & SET_INCREMENTAL_REHASH) {
+            res = __set_start_rehash(set, set->number_nodes * 2);
+        } else {
+            res = __set_resize(set, set->number_nodes * 2);
         }
-        set->nodes = tmp;
-        uint64_t i, orig_num_els = set->number_nodes;
-        for (i = orig_num_els; i < num_els; i++) {
-            set->nodes[i] = NULL;
+        if (res != SET_TRUE) {
+            return SET_MALLOC_ERROR;
         }
-        set->number_nodes = num_els;
-        // re-layout all nodes
-        __relayout_nodes(set, 0, 1);
     }
-    // add element in
-    int res = __get_index(set, key, hash, &index);
-    if (res == SET_FALSE) { // this is the first open slot
-        __assign_node(set, key, index, data);
-        set->used_nodes++;
-        uint64_t expected_index = hash % set->number_nodes;
-        if (expected_index != index) {
-            set->n_collisions++;
+    // add element in where Robin Hood probing says it belongs
+    index = __get_insert_index(set, hash);
+    if (__assign_node(set, key, hash, index, data) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
+    set->used_nodes++;
+    return SET_TRUE;
+}
+
+static int __get_data(SimpleSet *set, void *key, uint64_t hash, void **data) {
+    uint64_t index;
+    int result = __get_index(set, key, hash, &index);
+    if (result == SET_TRUE) {
+        *data = set->nodes[index]._data;
+    } else if (__get_old_index(set, key, hash, &index) == SET_TRUE) {
+        *data = set->old_nodes[index]._data;
+        result = SET_TRUE;
+    }
+    return result;
+}
+
+/*  Look keys up a block at a time: hash the whole block, then while probing
+    key i prefetch the home slot of key i + SET_PREFETCH_DISTANCE and the key
+    stored in the (by then cached) home slot of key i + SET_PREFETCH_DISTANCE
+    / 2, so the cache misses of several lookups overlap. Only the current
+    table is prefetched; keys still in the old table of an incremental rehash
+    are found but not prefetched. */
+static void __lookup_many(SimpleSet *set, void **keys, uint64_t n, void **datas, int *results) {
+    uint64_t hashes[SET_BATCH_SIZE], homes[SET_BATCH_SIZE];
+    uint64_t start, i, m;
+    for (start = 0; start < n; start += SET_BATCH_SIZE) {
+        m = (n - start < SET_BATCH_SIZE) ? n - start : SET_BATCH_SIZE;
+        __rehash_step(set, SET_REHASH_BUCKETS * m);
+        for (i = 0; i < m; i++) {
+            hashes[i] = set->hash_function(keys[start + i], set->global);
+            homes[i] = __home_index(set, hashes[i], set->number_nodes);
+        }
+        for (i = 0; i < m && i < SET_PREFETCH_DISTANCE; i++) {
+            __prefetch_slot(set, homes[i]);
+        }
+        for (i = 0; i < m; i++) {
+            if (i + SET_PREFETCH_DISTANCE < m) {
+                __prefetch_slot(set, homes[i + SET_PREFETCH_DISTANCE]);
+            }
+            if (i + SET_PREFETCH_DISTANCE / 2 < m) {
+                __builtin_prefetch(set->nodes[homes[i + SET_PREFETCH_DISTANCE / 2]]._key, 0, 1);
+            }
+            if (datas == NULL) {
+                results[start + i] = __set_contains(set, keys[start + i], hashes[i]);
+            } else {
+                datas[start + i] = NULL;
+                results[start + i] = __get_data(set, keys[start + i], hashes[i], &datas[start + i]);
+            }
         }
-        return SET_TRUE;
-    } else {
-        return res;
     }
 }
 
+/*  Scan the control bytes a group at a time starting at the home slot. Only
+    slots whose tag matches are compared with equals_function, and the scan
+    stops at the first group that contains an empty slot. */
 static int __get_index(SimpleSet *set, void *key, uint64_t hash, uint64_t *index) {
-    uint64_t i, idx;
-    idx = hash % set->number_nodes;
-    i = idx;
+    return __find_index(set, set->nodes, set->ctrl, set->number_nodes, key, hash, index);
+}
+
+/* Look key up in the table being migrated away from, if any */
+static int __get_old_index(SimpleSet *set, void *key, uint64_t hash, uint64_t *index) {
+    if (set->old_nodes == NULL) {
+        return SET_FALSE;
+    }
+    return __find_index(set, set->old_nodes, set->old_ctrl, set->old_number_nodes, key, hash, index);
+}
+
+static int __find_index(SimpleSet *set, simple_set_node *nodes, uint8_t *ctrl, uint64_t number_nodes,
+        void *key, uint64_t hash, uint64_t *index) {
+    uint64_t i, scanned = 0;
+    uint8_t tag = __hash_tag(hash);
+    i = __home_index(set, hash, number_nodes);
     while (1) {
-        if (set->nodes[i] == NULL) {
-            *index = i;
-            return SET_FALSE; // not here OR first open slot
-        } else if (set->equals_function(set->nodes[i]->_key, key, set->global)) {
-            *index = i;
-            return SET_TRUE;
-        } else {
-            i++;
-            if (i == set->number_nodes) {
-                i = 0;
+        uint32_t match = __match_group(ctrl + i, tag);
+        uint32_t empty = __match_group(ctrl + i, SET_CTRL_EMPTY);
+        if (empty != 0) { // nothing past the first empty slot can be ours
+            match &= (empty & (~empty + 1)) - 1;
+        }
+        while (match != 0) {
+            uint64_t j = i + __builtin_ctz(match);
+            while (j >= number_nodes) {
+                j -= number_nodes;
             }
-
-            if (i == idx) { // this means we went all the way around and the set is full
-                return SET_CIRCULAR_ERROR;
+            if (nodes[j]._hash == hash && set->equals_function(nodes[j]._key, key, set->global)) {
+                *index = j;
+                return SET_TRUE;
             }
+            match &= match - 1;
+        }
+        if (empty != 0) {
+            return SET_FALSE;
+        }
+        scanned += SET_GROUP_WIDTH;
+        if (scanned >= number_nodes) { // this means we went all the way around and the set is full
+            return SET_CIRCULAR_ERROR;
         }
+        i += SET_GROUP_WIDTH;
+        while (i >= number_nodes) {
+            i -= number_nodes;
+        }
+    }
+}
+
+/*  Robin Hood probing: a key that is not in the set belongs in the first
+    slot that is empty or holds a node closer to its home than the key would
+    be. There is always an empty slot as the set grows before it fills. */
+static uint64_t __get_insert_index(SimpleSet *set, uint64_t hash) {
+    uint64_t i, dist = 0;
+    i = __home_index(set, hash, set->number_nodes);
+    while (set->ctrl[i] != SET_CTRL_EMPTY && set->nodes[i]._dist >= dist) {
+        i++;
+        if (i == set->number_nodes) {
+            i = 0;
+        }
+        dist++;
     }
+    return i;
 }
 
-static int __assign_node(SimpleSet *set, void *key, uint64_t index, void *data) {
-    set->nodes[index] = malloc(sizeof(simple_set_node));
-    set->nodes[index]->_key = set->copy_function(key, set->global);
-    set->nodes[index]->_data = data;
+/*  Map a hash to its home slot. The default is hash % number_nodes; power of
+    two tables mask the low bits and fastrange tables take the high 64 bits
+    of hash * number_nodes, avoiding the division. Both run the hash through
+    a finalizer first since neither can rely on the modulo to mix in the
+    bits they drop. */
+static uint64_t __home_index(SimpleSet *set, uint64_t hash, uint64_t number_nodes) {
+    if (set->flags & SET_POWER_OF_TWO) {
+        return __mix_hash(hash) & (number_nodes - 1);
+    } else if (set->flags & SET_FASTRANGE) {
+        __extension__ typedef unsigned __int128 uint128;
+        return (uint64_t) (((uint128) __mix_hash(hash) * number_nodes) >> 64);
+    }
+    return hash % number_nodes;
+}
+
+/* Pull the control group and node at index into cache ahead of a probe */
+static void __prefetch_slot(SimpleSet *set, uint64_t index) {
+    __builtin_prefetch(set->ctrl + index, 1, 1);
+    __builtin_prefetch(set->nodes + index, 1, 1);
+}
+
+/* 64 bit finalizer from MurmurHash3 */
+static uint64_t __mix_hash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint64_t __round_up_pow2(uint64_t num) {
+    uint64_t res = 1;
+    while (res < num) {
+        res <<= 1;
+    }
+    return res;
+}
+
+/* Occupied slots store 7 bits of the hash with the high bit set */
+static uint8_t __hash_tag(uint64_t hash) {
+    return (uint8_t) (0x80 | (hash >> 57));
+}
+
+/* Bitmask of the control bytes in the group starting at ctrl equal to tag */
+static uint32_t __match_group(const uint8_t *ctrl, uint8_t tag) {
+#if defined(__AVX2__)
+    __m256i group = _mm256_loadu_si256((const __m256i *) ctrl);
+    return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(group, _mm256_set1_epi8((char) tag)));
+#elif defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) tag)));
+#else
+    uint32_t i, mask = 0;
+    for (i = 0; i < SET_GROUP_WIDTH; i++) {
+        mask |= (uint32_t) (ctrl[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+static void __set_ctrl(SimpleSet *set, uint64_t index, uint8_t tag) {
+    __set_ctrl_in(set->ctrl, set->number_nodes, index, tag);
+    uint64_t *word = &__occupied(set)[index / 64];
+    if (tag == SET_CTRL_EMPTY) {
+        *word &= ~(1ULL << (index % 64));
+    } else {
+        *word |= 1ULL << (index % 64);
+    }
+}
+
+/*  The control bytes are followed (8 byte aligned) by the occupancy bitmap,
+    one bit per slot, so that walks over the set can skip empty slots 64 at
+    a time; only the current table's bitmap is kept up to date */
+static uint64_t __ctrl_bytes(uint64_t num_els) {
+    return (num_els + SET_GROUP_WIDTH + 7) & ~(uint64_t) 7;
+}
+
+static uint64_t* __occupied(SimpleSet *set) {
+    return (uint64_t *) (set->ctrl + __ctrl_bytes(set->number_nodes));
+}
+
+/* The first occupied slot at or after from, or number_nodes if there is none */
+static uint64_t __next_occupied(SimpleSet *set, uint64_t from) {
+    if (from >= set->number_nodes) {
+        return set->number_nodes;
+    }
+    uint64_t *occupied = __occupied(set);
+    uint64_t w = from / 64, n_words = (set->number_nodes + 63) / 64;
+    uint64_t bits = occupied[w] & (~0ULL << (from % 64));
+    while (bits == 0) {
+        if (++w == n_words) {
+            return set->number_nodes;
+        }
+        bits = occupied[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+/* Set a control byte along with its mirrored copies past the end */
+static void __set_ctrl_in(uint8_t *ctrl, uint64_t number_nodes, uint64_t index, uint8_t tag) {
+    ctrl[index] = tag;
+    if (index < SET_GROUP_WIDTH) {
+        uint64_t j;
+        for (j = index + number_nodes; j < number_nodes + SET_GROUP_WIDTH; j += number_nodes) {
+            ctrl[j] = tag;
+        }
+    }
+}
+
+static int __assign_node(SimpleSet *set, void *key, uint64_t hash, uint64_t index, void *data) {
+    void *copy = __copy_key(set, key);
+    if (copy == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    __place_copy(set, copy, hash, index, data);
     return SET_TRUE;
 }
+/*  Put a key the set already owns at index (see __get_insert_index) */
+static void __place_copy(SimpleSet *set, void *copy, uint64_t hash, uint64_t index, void *data) {
+    simple_set_node node;
+    node._key = copy;
+    node._data = data;
+    node._hash = hash;
+    uint64_t home = __home_index(set, hash, set->number_nodes);
+    node._dist = (index >= home) ? index - home : index + set->number_nodes - home;
+    if (node._dist != 0) {
+        set->n_collisions++;
+    }
+    __insert_node(set, node, __hash_tag(hash), index);
+}
 
+/*  Place node at index, which is node._dist slots away from its home. Any
+    node that is closer to its own home is displaced and carried forward
+    along with its control byte. */
+static void __insert_node(SimpleSet *set, simple_set_node node, uint8_t tag, uint64_t index) {
+    simple_set_node tmp;
+    uint8_t tmp_tag;
+    while (set->ctrl[index] != SET_CTRL_EMPTY) {
+        if (set->nodes[index]._dist < node._dist) {
+            tmp = set->nodes[index];
+            tmp_tag = set->ctrl[index];
+            set->nodes[index] = node;
+            __set_ctrl(set, index, tag);
+            node = tmp;
+            tag = tmp_tag;
+        }
+        node._dist++;
+        index++;
+        if (index == set->number_nodes) {
+            index = 0;
+        }
+    }
+    set->nodes[index] = node;
+    __set_ctrl(set, index, tag);
+}
+
+/*  Free the node at index and shift the following displaced nodes back one
+    slot each so that no holes are left inside the cluster */
 static void __free_index(SimpleSet *set, uint64_t index) {
-    set->free_function(set->nodes[index]->_key, set->global);
-    free(set->nodes[index]);
-    set->nodes[index] = NULL;
-}
-
-static void __relayout_nodes(SimpleSet *set, uint64_t start, short end_on_null) {
-    uint64_t index = 0, i;
-    for (i = start; i < set->number_nodes; i++) {
-        if(set->nodes[i] != NULL) {
-            uint64_t hash = set->hash_function(set->nodes[i]->_key, set->global);
-            __get_index(set, set->nodes[i]->_key, hash, &index);
-            if (i != index) { // we are moving this node
-                __assign_node(set, set->nodes[i]->_key, index, set->nodes[i]->_data);
-                __free_index(set, i);
-            }
-        } else if (end_on_null == 0 && i != start) {
+    __free_key(set, set->nodes[index]._key);
+    uint64_t next = index + 1;
+    if (next == set->number_nodes) {
+        next = 0;
+    }
+    while (set->ctrl[next] != SET_CTRL_EMPTY && set->nodes[next]._dist != 0) {
+        set->nodes[index] = set->nodes[next];
+        set->nodes[index]._dist--;
+        __set_ctrl(set, index, set->ctrl[next]);
+        index = next;
+        next++;
+        if (next == set->number_nodes) {
+            next = 0;
+        }
+    }
+    set->nodes[index]._key = NULL;
+    set->nodes[index]._data = NULL;
+    set->nodes[index]._hash = 0;
+    set->nodes[index]._dist = 0;
+    __set_ctrl(set, index, SET_CTRL_EMPTY);
+}
+
+/*  Remove every key of set that is (in_other == SET_TRUE) or is not
+    (SET_FALSE) in other. Removing shifts the rest of the cluster back one
+    slot, so the slot just emptied is looked at again. */
+static void __remove_where(SimpleSet *set, SimpleSet *other, int in_other) {
+    uint64_t i = __next_occupied(set, 0);
+    while (i < set->number_nodes) {
+        int found = __set_contains(other, set->nodes[i]._key, __node_hash(set, i, other)) == SET_TRUE;
+        if (found == (in_other == SET_TRUE)) {
+            __free_index(set, i);
+            set->used_nodes--;
+            i = __next_occupied(set, i);
+        } else {
+            i = __next_occupied(set, i + 1);
+        }
+    }
+}
+
+/*  Intersect set with a smaller other by looking other's keys up in set:
+    the nodes found are lifted out, everything left is freed, and the lifted
+    nodes (key copies and data intact) are put back. SET_MALLOC_ERROR if
+    there was no room to hold them, in which case set is untouched. */
+static int __keep_common(SimpleSet *set, SimpleSet *other) {
+    uint64_t i, index, n_keep = 0;
+    simple_set_node *keep = malloc((other->used_nodes + 1) * sizeof(simple_set_node));
+    if (keep == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    for (i = __next_occupied(other, 0); i < other->number_nodes; i = __next_occupied(other, i + 1)) {
+        if (__get_index(set, other->nodes[i]._key, __node_hash(other, i, set), &index) == SET_TRUE) {
+            keep[n_keep++]._hash = index;  // lift them only once every lookup is done
+        }
+    }
+    for (i = 0; i < n_keep; i++) {
+        index = keep[i]._hash;
+        keep[i] = set->nodes[index];
+        set->nodes[index]._key = NULL;  // not freed below
+    }
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        if (set->nodes[i]._key != NULL) {
+            __free_key(set, set->nodes[i]._key);
+        }
+        memset(&set->nodes[i], 0, sizeof(simple_set_node));
+        __set_ctrl(set, i, SET_CTRL_EMPTY);
+    }
+    for (i = 0; i < n_keep; i++) {
+        keep[i]._dist = 0;
+        __insert_node(set, keep[i], __hash_tag(keep[i]._hash), __home_index(set, keep[i]._hash, set->number_nodes));
+    }
+    set->used_nodes = n_keep;
+    set->n_collisions = 0;
+    free(keep);
+    return SET_TRUE;
+}
+
+/*  Walk one part; only reads the two sets, so any number of these can run
+    at once as long as neither set changes */
+static void* __part_worker(void *arg) {
+    simple_set_part *part = (simple_set_part *) arg;
+    SimpleSet *set = part->set, *other = part->other;
+    uint64_t i, index = 0;
+    for (i = __next_occupied(set, part->start); i < part->end; i = __next_occupied(set, i + 1)) {
+        if (part->stop != NULL && __atomic_load_n(part->stop, __ATOMIC_RELAXED)) {
             break;
         }
+        int found = (part->mode == SET_PART_ALL)
+            || __get_index(other, set->nodes[i]._key, __node_hash(set, i, other), &index) == SET_TRUE;
+        if (found == (part->mode == SET_PART_MISSING)) {
+            continue;
+        }
+        if (part->stop != NULL) {
+            part->n_indices++;
+            __atomic_store_n(part->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (part->n_indices == part->max_indices) {
+            uint64_t max_indices = (part->max_indices == 0) ? 1024 : part->max_indices * 2;
+            uint64_t *indices = realloc(part->indices, max_indices * sizeof(uint64_t));
+            if (indices == NULL) {
+                part->error = SET_MALLOC_ERROR;
+                break;
+            }
+            part->indices = indices;
+            part->max_indices = max_indices;
+        }
+        part->indices[part->n_indices++] = (part->mode == SET_PART_MATCH) ? index : i;
+    }
+    if (part->res != NULL && part->error == SET_TRUE) {
+        __copy_part(part);
+    }
+    return NULL;
+}
+static void __copy_part(simple_set_part *part) {
+    SimpleSet *from = (part->mode == SET_PART_MATCH) ? part->other : part->set;
+    uint64_t j;
+    if (part->n_indices == 0) {
+        return;
+    }
+    part->copies = malloc(part->n_indices * sizeof(void *));
+    part->hashes = malloc(part->n_indices * sizeof(uint64_t));
+    if (part->copies == NULL || part->hashes == NULL) {
+        part->error = SET_MALLOC_ERROR;
+        return;
+    }
+    for (j = 0; j < part->n_indices; j++) {
+        uint64_t i = part->indices[j];
+        part->hashes[j] = __node_hash(from, i, part->res);
+        part->copies[j] = __copy_key(part->res, from->nodes[i]._key);
+        if (part->copies[j] == NULL) {
+            part->error = SET_MALLOC_ERROR;
+            return;
+        }
+        part->n_copies++;
+    }
+}
+
+/*  Split the slots of set into up to n_threads parts and walk them, one per
+    thread; the calling thread takes the first part, and any part that no
+    thread could be started for. Returns the parts (n_parts of them) or
+    NULL on malloc failure */
+static simple_set_part* __run_parts(SimpleSet *set, SimpleSet *other, int mode, int *stop, SimpleSet *res, int n_threads, int *n_parts) {
+    uint64_t max_parts = set->number_nodes / SET_PARALLEL_MIN_SLOTS;
+    int t;
+    if ((uint64_t) n_threads > max_parts) {
+        n_threads = (int) max_parts;
+    }
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+    simple_set_part *parts = calloc(n_threads, sizeof(simple_set_part));
+    if (parts == NULL) {
+        return NULL;
+    }
+    for (t = 0; t < n_threads; t++) {
+        parts[t].set = set;
+        parts[t].other = other;
+        parts[t].start = set->number_nodes * t / n_threads;
+        parts[t].end = set->number_nodes * (t + 1) / n_threads;
+        parts[t].mode = mode;
+        parts[t].stop = stop;
+        // arena copies come from one bump pointer, so res makes them itself
+        parts[t].res = (res != NULL && res->arena.key_size == 0) ? res : NULL;
+        parts[t].error = SET_TRUE;
+    }
+    for (t = 1; t < n_threads; t++) {
+        parts[t].started = pthread_create(&parts[t].thread, NULL, __part_worker, &parts[t]) == 0;
+    }
+    __part_worker(&parts[0]);
+    for (t = 1; t < n_threads; t++) {
+        if (parts[t].started) {
+            pthread_join(parts[t].thread, NULL);
+        } else {
+            __part_worker(&parts[t]);
+        }
+    }
+    *n_parts = n_threads;
+    return parts;
+}
+
+static uint64_t __parts_found(simple_set_part *parts, int n_parts) {
+    uint64_t total = 0;
+    int t;
+    for (t = 0; t < n_parts; t++) {
+        total += parts[t].n_indices;
+    }
+    return total;
+}
+
+/*  Add the key and data at every slot of from recorded in parts to res,
+    after reserving room for them and extra more keys. The recorded keys
+    are distinct and not in res yet, so copies made by the workers go
+    straight into their Robin Hood slot without a lookup */
+static int __add_parts(SimpleSet *res, SimpleSet *from, simple_set_part *parts, int n_parts, uint64_t extra) {
+    uint64_t j;
+    int t;
+    for (t = 0; t < n_parts; t++) {
+        if (parts[t].error != SET_TRUE) {
+            return parts[t].error;
+        }
+    }
+    if (set_reserve(res, __parts_found(parts, n_parts) + extra) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
+    for (t = 0; t < n_parts; t++) {
+        for (j = 0; j < parts[t].n_indices; j++) {
+            uint64_t i = parts[t].indices[j];
+            if (parts[t].res != NULL) {
+                uint64_t hash = parts[t].hashes[j];
+                __place_copy(res, parts[t].copies[j], hash, __get_insert_index(res, hash), from->nodes[i]._data);
+                res->used_nodes++;
+            } else if (__set_add(res, from->nodes[i]._key, __node_hash(from, i, res), from->nodes[i]._data) == SET_MALLOC_ERROR) {
+                return SET_MALLOC_ERROR;
+            }
+        }
+        parts[t].n_copies = 0;  // res owns them now
+    }
+    return SET_TRUE;
+}
+
+static void __free_parts(simple_set_part *parts, int n_parts) {
+    uint64_t j;
+    int t;
+    for (t = 0; t < n_parts; t++) {
+        for (j = 0; j < parts[t].n_copies; j++) {
+            __free_key(parts[t].res, parts[t].copies[j]);
+        }
+        free(parts[t].indices);
+        free(parts[t].copies);
+        free(parts[t].hashes);
+    }
+    free(parts);
+}
+
+static int __set_resize(SimpleSet *set, uint64_t num_els) {
+    simple_set_node *old_nodes = set->nodes;
+    uint8_t *old_ctrl = set->ctrl;
+    uint64_t i, old_num_els = set->number_nodes;
+    if (__alloc_table(set, num_els, &set->nodes, &set->ctrl) != SET_TRUE) { // malloc failure
+        set->nodes = old_nodes;
+        set->ctrl = old_ctrl;
+        return SET_MALLOC_ERROR;
+    }
+    set->number_nodes = num_els;
+    // re-insert all nodes using their cached hashes; the key copies move with them
+    for (i = 0; i < old_num_els; i++) {
+        if (old_ctrl[i] != SET_CTRL_EMPTY) {
+            old_nodes[i]._dist = 0;
+            __insert_node(set, old_nodes[i], old_ctrl[i], __home_index(set, old_nodes[i]._hash, num_els));
+        }
+    }
+    __free_table(set, old_num_els, old_nodes, old_ctrl);
+    return SET_TRUE;
+}
+
+/*  Incremental rehash: allocate the new table but leave every node in the
+    old one. Inserts and lookups then migrate a few old slots at a time until
+    the old table is empty and can be released. */
+static int __set_start_rehash(SimpleSet *set, uint64_t num_els) {
+    __rehash_finish(set);
+    simple_set_node *old_nodes = set->nodes;
+    uint8_t *old_ctrl = set->ctrl;
+    if (__alloc_table(set, num_els, &set->nodes, &set->ctrl) != SET_TRUE) { // malloc failure
+        set->nodes = old_nodes;
+        set->ctrl = old_ctrl;
+        return SET_MALLOC_ERROR;
+    }
+    set->old_nodes = old_nodes;
+    set->old_ctrl = old_ctrl;
+    set->old_number_nodes = set->number_nodes;
+    set->number_nodes = num_els;
+    set->rehash_index = 0;
+    return SET_TRUE;
+}
+
+/*  Move up to n_buckets slots of the old table into the new one. Migrated
+    slots are marked rather than emptied so that lookups can still probe
+    past them to keys further along the old cluster. */
+static int __rehash_step(SimpleSet *set, uint64_t n_buckets) {
+    if (set->old_nodes == NULL) {
+        return SET_TRUE;
+    }
+    uint64_t i, end = set->old_number_nodes;
+    if (n_buckets < end - set->rehash_index) {
+        end = set->rehash_index + n_buckets;
+    }
+    for (i = set->rehash_index; i < end; i++) {
+        uint8_t tag = set->old_ctrl[i];
+        if (tag != SET_CTRL_EMPTY && tag != SET_CTRL_MOVED) {
+            simple_set_node node = set->old_nodes[i];
+            node._dist = 0;
+            __insert_node(set, node, tag, __home_index(set, node._hash, set->number_nodes));
+            __set_ctrl_in(set->old_ctrl, set->old_number_nodes, i, SET_CTRL_MOVED);
+        }
+    }
+    set->rehash_index = end;
+    if (end < set->old_number_nodes) {
+        return SET_FALSE;
+    }
+    __free_table(set, set->old_number_nodes, set->old_nodes, set->old_ctrl);
+    set->old_nodes = NULL;
+    set->old_ctrl = NULL;
+    set->old_number_nodes = 0;
+    set->rehash_index = 0;
+    return SET_TRUE;
+}
+
+static void __rehash_finish(SimpleSet *set) {
+    __rehash_step(set, UINT64_MAX);
+}
+
+static int __alloc_table(SimpleSet *set, uint64_t num_els, simple_set_node **nodes, uint8_t **ctrl) {
+    set_allocator *a = &set->allocator;
+    *nodes = (simple_set_node*) a->alloc_function(num_els * sizeof(simple_set_node), a->context);
+    *ctrl = (uint8_t*) a->alloc_function(__ctrl_bytes(num_els) + (num_els + 63) / 64 * sizeof(uint64_t), a->context);
+    if (*nodes == NULL || *ctrl == NULL) {
+        __free_table(set, num_els, *nodes, *ctrl);
+        return SET_MALLOC_ERROR;
+    }
+    return SET_TRUE;
+}
+
+static void __free_table(SimpleSet *set, uint64_t num_els, simple_set_node *nodes, uint8_t *ctrl) {
+    set_allocator *a = &set->allocator;
+    if (nodes != NULL) {
+        a->free_function(nodes, num_els * sizeof(simple_set_node), a->context);
+    }
+    if (ctrl != NULL) {
+        a->free_function(ctrl, __ctrl_bytes(num_els) + (num_els + 63) / 64 * sizeof(uint64_t), a->context);
     }
 }
 
 static void __set_clear(SimpleSet *set) {
+    __rehash_finish(set);
     uint64_t i;
-    for(i = 0; i < set->number_nodes; i++) {
-        if (set->nodes[i] != NULL) {
-            __free_index(set, i);
+    if (set->arena.key_size != 0) {
+        // the keys all live in the arena; drop it wholesale
+        __arena_release(set, 1);
+    }
+    // only the occupied slots need to be reset
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        if (set->arena.key_size == 0) {
+            set->free_function(set->nodes[i]._key, set->global);
         }
+        memset(&set->nodes[i], 0, sizeof(simple_set_node));
+        __set_ctrl(set, i, SET_CTRL_EMPTY);
     }
     set->used_nodes = 0;
     set->n_collisions = 0;
 }
+
+static void* __copy_key(SimpleSet *set, void *key) {
+    if (set->arena.key_size == 0) {
+        return set->copy_function(key, set->global);
+    }
+    void *copy = __arena_alloc(set);
+    if (copy != NULL) {
+        memcpy(copy, key, set->arena.key_size);
+    }
+    return copy;
+}
+
+static void __free_key(SimpleSet *set, void *key) {
+    if (set->arena.key_size == 0) {
+        set->free_function(key, set->global);
+        return;
+    }
+    // removed keys are threaded through their own storage for reuse
+    *(void **) key = set->arena.free_list;
+    set->arena.free_list = key;
+}
+
+/*  Each chunk starts with the pointer to the previously allocated chunk,
+    padded so that the keys after it stay 16 byte aligned */
+#define SET_ARENA_HEADER 16
+
+static uint64_t __arena_chunk_size(simple_set_arena *arena) {
+    if (SET_ARENA_CHUNK_SIZE < SET_ARENA_HEADER + arena->slot_size) {
+        return SET_ARENA_HEADER + arena->slot_size;
+    }
+    return SET_ARENA_CHUNK_SIZE;
+}
+
+static void* __arena_alloc(SimpleSet *set) {
+    simple_set_arena *arena = &set->arena;
+    void *slot = arena->free_list;
+    if (slot != NULL) {
+        arena->free_list = *(void **) slot;
+        return slot;
+    }
+    if (arena->next == NULL || (uint64_t)(arena->end - arena->next) < arena->slot_size) {
+        uint64_t size = __arena_chunk_size(arena);
+        char *chunk = (char *) set->allocator.alloc_function(size, set->allocator.context);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        *(void **) chunk = arena->chunks;
+        arena->chunks = chunk;
+        arena->next = chunk + SET_ARENA_HEADER;
+        arena->end = chunk + size;
+    }
+    slot = arena->next;
+    arena->next += arena->slot_size;
+    return slot;
+}
+
+/*  Free all of the arena's chunks; with keep_one the newest chunk is kept and
+    reset so that refilling a cleared set does not go back to malloc */
+static void __arena_release(SimpleSet *set, int keep_one) {
+    simple_set_arena *arena = &set->arena;
+    uint64_t size = __arena_chunk_size(arena);
+    char *chunk = (char *) arena->chunks;
+    if (keep_one && chunk != NULL) {
+        char *prev = (char *) *(void **) chunk;
+        while (prev != NULL) {
+            char *tmp = (char *) *(void **) prev;
+            set->allocator.free_function(prev, size, set->allocator.context);
+            prev = tmp;
+        }
+        *(void **) chunk = NULL;
+        arena->next = chunk + SET_ARENA_HEADER;
+    } else {
+        while (chunk != NULL) {
+            char *tmp = (char *) *(void **) chunk;
+            set->allocator.free_function(chunk, size, set->allocator.context);
+            chunk = tmp;
+        }
+        arena->chunks = NULL;
+        arena->next = NULL;
+        arena->end = NULL;
+    }
+    arena->free_list = NULL;
+}
@@ -20,34 +20,102 @@
 #endif
 
 #include <inttypes.h>       /* uint64_t */
+#include "set_allocator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef uint64_t (*key_hash_function) (void *key, void *global);
 typedef int (*key_equals_function) (void *key_1, void *key_2, void *global);
 typedef void* (*key_copy_function) (void *key, void *global);
 typedef void (*key_free_function) (void *key, void *global);
+typedef void (*set_visitor) (void *key, void *data, void *context);
 
+/*  Nodes are stored inline in the node table; an empty slot has a NULL _key.
+    _hash caches the key's hash so growth and set operations never rehash;
+    _dist is how far the node sits from its home slot (Robin Hood probing) */
 typedef struct  {
     void *_key;
     void *_data;
+    uint64_t _hash;
+    uint32_t _dist;
 } SimpleSetNode, simple_set_node;
 
+/*  Optional per-set arena for key copies (see set_init_arena): keys are
+    bump allocated out of large chunks, removed keys are kept on free_list
+    for reuse and set_clear / set_destroy release whole chunks. key_size is 0
+    when the set copies and frees keys with its copy / free functions;
+    slot_size is key_size rounded up to hold an aligned free list link */
 typedef struct  {
-    simple_set_node **nodes;
+    void *chunks;
+    char *next;
+    char *end;
+    void *free_list;
+    uint64_t key_size;
+    uint64_t slot_size;
+} SimpleSetArena, simple_set_arena;
+
+/*  ctrl holds one byte per node: 0 for an empty slot, otherwise the high bit
+    plus 7 bits of the key's hash so lookups can compare a group of slots at
+    once and only call equals_function on likely matches */
+/*  While an incremental rehash is in progress old_nodes / old_ctrl hold the
+    table being migrated away from; old slots before rehash_index have
+    already been moved into nodes / ctrl */
+typedef struct  {
+    simple_set_node *nodes;
+    uint8_t *ctrl;
+    simple_set_node *old_nodes;
+    uint8_t *old_ctrl;
+    uint64_t old_number_nodes;
+    uint64_t rehash_index;
     void *global;
     uint64_t number_nodes;
     uint64_t used_nodes;
     uint64_t n_collisions;
+    int flags;
     key_hash_function hash_function;
     key_equals_function equals_function;
     key_copy_function copy_function;
     key_free_function free_function;
+    simple_set_arena arena;
+    set_allocator allocator;
 } SimpleSet, simple_set;
 
+/*  Cursor over the keys of a set, see set_iter_begin */
+typedef struct  {
+    SimpleSet *set;
+    uint64_t index;
+} SimpleSetIterator, simple_set_iterator;
+
 /* Initialize the set */
 int set_init(SimpleSet *set, void *global, uint64_t init_size,
         key_hash_function hash, key_equals_function equals,
         key_copy_function copy, key_free_function free);
 
+/*  Initialize the set with flags (a combination of the SET_* flags below),
+    e.g. SET_INCREMENTAL_REHASH */
+int set_init_alt(SimpleSet *set, void *global, uint64_t init_size,
+        key_hash_function hash, key_equals_function equals,
+        key_copy_function copy, key_free_function free, int flags);
+
+/*  Initialize a set that keeps its key copies in an arena instead of calling
+    a copy / free function per key. Keys are key_size bytes and copied with
+    memcpy, so they must not own other memory. set_clear and set_destroy
+    release the arena a chunk at a time; set_to_array still returns keys the
+    caller frees with free() */
+int set_init_arena(SimpleSet *set, void *global, uint64_t init_size,
+        key_hash_function hash, key_equals_function equals,
+        uint64_t key_size, int flags);
+
+/*  Initialize the set with flags and an allocator for the node and control
+    tables and the arena chunks (see set_allocator.h); a NULL allocator uses
+    calloc / free. Key copies still come from copy / free */
+int set_init_allocator(SimpleSet *set, void *global, uint64_t init_size,
+        key_hash_function hash, key_equals_function equals,
+        key_copy_function copy, key_free_function free, int flags,
+        const set_allocator *allocator);
+
 /* Utility function to clear out the set */
 int set_clear(SimpleSet *set);
 
@@ -65,6 +133,18 @@ int set_add(SimpleSet *set, void *key);
     completely full */
 int set_add_with_data(SimpleSet *set, void *key, void *data);
 
+/*  Make room for n_elements more elements so that adding them will not grow
+    the set; Returns SET_TRUE or SET_MALLOC_ERROR */
+int set_reserve(SimpleSet *set, uint64_t n_elements);
+
+/*  Add n keys at once, with datas[i] as the data of keys[i] (datas may be
+    NULL). If results is not NULL, results[i] receives what set_add_with_data
+    would have returned for keys[i]. The set is grown once for the whole batch,
+    keys are hashed a block at a time and the home slots of upcoming keys are
+    prefetched while earlier ones are inserted; Returns SET_TRUE, or
+    SET_MALLOC_ERROR if the set could not be grown (nothing is added) */
+int set_add_batch(SimpleSet *set, void **keys, void **datas, uint64_t n, int *results);
+
 /*  Remove element from the set; Returns SET_TRUE if removed, SET_FALSE if
     not present */
 int set_remove(SimpleSet *set, void *key);
@@ -78,9 +158,36 @@ int set_contains(SimpleSet *set, void *key);
     if not found, data will remain invalid. */
 int set_get_data(SimpleSet *set, void *key, void **data);
 
+/*  Check n keys at once; results[i] receives what set_contains would return
+    for keys[i]. Lookups are pipelined so that the cache misses of several
+    keys overlap; Returns SET_TRUE */
+int set_contains_many(SimpleSet *set, void **keys, uint64_t n, int *results);
+
+/*  Get the data of n keys at once; datas[i] receives the data of keys[i] (or
+    NULL if not found) and results[i] what set_get_data would return for
+    keys[i]; Returns SET_TRUE */
+int set_get_data_many(SimpleSet *set, void **keys, uint64_t n, void **datas, int *results);
+
+/*  A lookup split into steps for callers that interleave many lookups (see
+    hash_map_coro.hpp): set_hash hashes key, set_prefetch pulls the slot a
+    lookup of hash starts at into cache, set_prefetch_key then pulls in the
+    key stored there, and set_contains_hash / set_get_data_hash finish the
+    lookup with the hash already computed */
+uint64_t set_hash(SimpleSet *set, void *key);
+void set_prefetch(SimpleSet *set, uint64_t hash);
+void set_prefetch_key(SimpleSet *set, uint64_t hash);
+int set_contains_hash(SimpleSet *set, void *key, uint64_t hash);
+int set_get_data_hash(SimpleSet *set, void *key, uint64_t hash, void **data);
+
 /* Return the number of elements in the set */
 uint64_t set_length(SimpleSet *set);
 
+/*  NOTE: The set algebra functions that follow reserve room in res for
+          the largest possible result up front (the smaller set for an
+          intersection, both sets for a union) and return SET_MALLOC_ERROR
+          if that fails; an intersection walks the smaller set but keys and
+          data always come from s1 */
+
 /*  Set res to the union of s1 and s2
     res = s1 ∪ s2
 
@@ -112,6 +219,35 @@ int set_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
     A △ B or A * B */
 int set_symmetric_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
 
+/*  The sizes of the results above without building them: nothing is
+    copied or allocated, the smaller set's keys are just looked up in the
+    other
+    |s1 ∩ s2| */
+uint64_t set_intersection_count(SimpleSet *s1, SimpleSet *s2);
+
+/* |s1 ∪ s2| */
+uint64_t set_union_count(SimpleSet *s1, SimpleSet *s2);
+
+/* |s1 ∖ s2| */
+uint64_t set_difference_count(SimpleSet *s1, SimpleSet *s2);
+
+/*  In place versions of the above: dest is updated and keeps its storage,
+    so only the keys that differ are copied in or freed. Keys brought in
+    from src / other keep their data; keys already in dest keep theirs. The
+    intersection and difference walk whichever set is smaller. Returns
+    SET_TRUE, or SET_MALLOC_ERROR if a key could not be added
+    dest = dest ∪ src */
+int set_union_into(SimpleSet *dest, SimpleSet *src);
+
+/* dest = dest ∩ other */
+int set_intersect_update(SimpleSet *dest, SimpleSet *other);
+
+/* dest = dest ∖ other */
+int set_difference_update(SimpleSet *dest, SimpleSet *other);
+
+/* dest = dest △ other */
+int set_symmetric_difference_update(SimpleSet *dest, SimpleSet *other);
+
 /*  Return SET_TRUE if test is fully contained in s2; returns SET_FALSE
     otherwise
     test ⊆ against
@@ -155,6 +291,28 @@ int set_is_superset_strict(SimpleSet *test, SimpleSet *against);
           the type of the data originally provided */
 void *set_to_array(SimpleSet *set, uint64_t *size);
 
+/*  Walk the set without copying anything: after set_iter_begin each call to
+    set_iter_next points *key and *data (either may be NULL) at the stored
+    key and data of the next element and returns SET_TRUE, or returns
+    SET_FALSE once every element has been visited. The pointers are borrowed
+    from the set; the set must not be modified while it is being walked */
+void set_iter_begin(SimpleSet *set, simple_set_iterator *iter);
+int set_iter_next(simple_set_iterator *iter, void **key, void **data);
+
+/*  Call visitor(key, data, context) for every element of the set, with the
+    same borrowed pointers as set_iter_next */
+void set_foreach(SimpleSet *set, set_visitor visitor, void *context);
+
+/*  Migrate up to n_buckets slots of an incremental rehash in progress, e.g.
+    when idle. Returns SET_TRUE if no rehash is left in progress, or
+    SET_FALSE if more slots remain to be migrated */
+int set_rehash_step(SimpleSet *set, uint64_t n_buckets);
+
+/*  Fill histogram[d] with the number of keys that sit d slots away from
+    their home slot; the last bin also counts every longer probe. Returns the
+    longest probe length in the set */
+uint64_t set_probe_histogram(SimpleSet *set, uint64_t *histogram, uint64_t n_bins);
+
 /*  Returns based on number elements:
     -1 if left is less than right
     1 if right is less than left
@@ -162,6 +320,37 @@ void *set_to_array(SimpleSet *set, uint64_t *size);
     2 if size is the same but elements are different */
 int set_cmp(SimpleSet *left, SimpleSet *right);
 
+/*  Multi-threaded versions of set_union, set_intersection, set_difference,
+    set_is_subset and set_cmp with the same results. The slots of the set
+    being walked are split into up to n_threads ranges (each at least
+    65536 slots), and each range probes the other set on its own thread,
+    collecting its matches in a list of its own and copying their keys for
+    res. Only placing those copies in the presized res is left to the
+    calling thread; it needs no lookups or copies, but it is serial and
+    bounds the speedup of a large union or intersection. A res made with
+    set_init_arena copies its keys on the calling thread as well.
+
+    NOTE: The hash, equals and copy functions must be safe to call from
+          several threads at once, and none of the sets may be used by
+          another thread while these run. Link with -pthread. */
+int set_union_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, int n_threads);
+int set_intersection_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, int n_threads);
+int set_difference_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, int n_threads);
+int set_is_subset_parallel(SimpleSet *test, SimpleSet *against, int n_threads);
+int set_cmp_parallel(SimpleSet *left, SimpleSet *right, int n_threads);
+
+/*  set_init_alt flags
+    SET_INCREMENTAL_REHASH: grow into a new table while keeping the old one,
+    migrating a bounded number of slots on each insert or lookup instead of
+    moving every node at once
+    SET_POWER_OF_TWO: round the table size up to a power of two and find
+    slots with a mask of the (finalized) hash instead of a modulo
+    SET_FASTRANGE: keep the table size as is but find slots with a multiply
+    and shift of the (finalized) hash instead of a modulo */
+#define SET_INCREMENTAL_REHASH 0x1
+#define SET_POWER_OF_TWO 0x2
+#define SET_FASTRANGE 0x4
+
 #define SET_TRUE 0
 #define SET_FALSE -1
 #define SET_MALLOC_ERROR -2
@@ -174,5 +363,8 @@ int set_cmp(SimpleSet *left, SimpleSet *right);
 #define SET_EQUAL 0
 #define SET_UNEQUAL 2
 
+#ifdef __cplusplus
+} // extern "C"
+#endif
 
 #endif /* END _HASH_MAP_H */
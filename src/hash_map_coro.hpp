@@ -0,0 +1,46 @@
+/*******************************************************************************
+***
+***     Coroutine lookups for SimpleSet
+***
+***     Purpose: set_contains / set_get_data as lookup_task coroutines that
+***              suspend after each prefetch; run them with interleave()
+***
+***     License: MIT 2016
+***
+*******************************************************************************/
+
+#ifndef HASH_MAP_CORO_HPP__
+#define HASH_MAP_CORO_HPP__
+
+#include "hash_map.h"
+#include "lookup_task.hpp"
+
+namespace set_coro {
+
+/*  Same result as set_contains(set, key) */
+inline lookup_task<int> contains(SimpleSet *set, void *key) {
+    uint64_t hash = set_hash(set, key);
+    set_prefetch(set, hash);
+    co_await std::suspend_always();
+    set_prefetch_key(set, hash);
+    co_await std::suspend_always();
+    co_return set_contains_hash(set, key, hash);
+}
+
+/*  The data stored with key, or NULL if key is not in the set */
+inline lookup_task<void *> get_data(SimpleSet *set, void *key) {
+    void *data = NULL;
+    uint64_t hash = set_hash(set, key);
+    set_prefetch(set, hash);
+    co_await std::suspend_always();
+    set_prefetch_key(set, hash);
+    co_await std::suspend_always();
+    if (set_get_data_hash(set, key, hash, &data) != SET_TRUE) {
+        data = NULL;
+    }
+    co_return data;
+}
+
+} // namespace set_coro
+
+#endif /* END HASH_MAP_CORO_HPP__ */
@@ -0,0 +1,162 @@
+/*******************************************************************************
+***
+***     Interleaved lookups with C++20 coroutines
+***
+***     Purpose: Let per-key lookup code hide memory latency: each lookup is a
+***              coroutine that suspends after prefetching the memory its next
+***              step touches, and interleave() runs a window of lookups
+***              round-robin so their cache misses overlap
+***
+***     License: MIT 2016
+***
+***     Usage:
+***         interleave(8, n_keys,
+***             [&](uint64_t i) { return set_coro::contains(&set, keys[i]); },
+***             [&](uint64_t i, int res) { results[i] = res; });
+***
+*******************************************************************************/
+
+#ifndef LOOKUP_TASK_HPP__
+#define LOOKUP_TASK_HPP__
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+
+/*  Coroutine frames are recycled through a per-thread free list, so a
+    lookup does not cost a malloc and free once interleave() warms up. Every
+    frame on the list has the size of the first frame freed; other sizes go
+    straight to the global allocator. */
+struct lookup_frame_cache {
+    struct block {
+        block *next;
+    };
+    block *head = nullptr;
+    std::size_t size = 0;
+
+    ~lookup_frame_cache() {
+        while (head != nullptr) {
+            block *next = head->next;
+            ::operator delete(head);
+            head = next;
+        }
+    }
+
+    static lookup_frame_cache &local() {
+        thread_local lookup_frame_cache cache;
+        return cache;
+    }
+
+    void *take(std::size_t n) {
+        if (n == size && head != nullptr) {
+            block *b = head;
+            head = b->next;
+            return b;
+        }
+        return ::operator new(n < sizeof(block) ? sizeof(block) : n);
+    }
+
+    void give(void *p, std::size_t n) {
+        if (size == 0) {
+            size = n;
+        }
+        if (n != size) {
+            ::operator delete(p);
+            return;
+        }
+        block *b = static_cast<block *>(p);
+        b->next = head;
+        head = b;
+    }
+};
+
+/*  A lookup coroutine producing a T. It starts suspended, is resumed once per
+    step by interleave() and holds its result once done(). */
+template <typename T>
+class lookup_task {
+public:
+    struct promise_type {
+        T value;
+
+        lookup_task get_return_object() {
+            return lookup_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(std::size_t n) { return lookup_frame_cache::local().take(n); }
+        static void operator delete(void *p, std::size_t n) { lookup_frame_cache::local().give(p, n); }
+    };
+
+    lookup_task() : handle_(nullptr) {}
+    explicit lookup_task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    lookup_task(lookup_task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    lookup_task &operator=(lookup_task &&other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    lookup_task(const lookup_task &) = delete;
+    lookup_task &operator=(const lookup_task &) = delete;
+    ~lookup_task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool done() const { return handle_.done(); }
+    void resume() { handle_.resume(); }
+    T &result() { return handle_.promise().value; }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/*  Run the lookups make_lookup(0) ... make_lookup(n - 1) with up to width of
+    them in flight, resuming each in turn. on_result(i, result) is called as
+    lookup i finishes; results may arrive out of order. */
+template <typename MakeLookup, typename OnResult>
+void interleave(uint64_t width, uint64_t n, MakeLookup make_lookup, OnResult on_result) {
+    using task = decltype(make_lookup(uint64_t(0)));
+    std::vector<task> slots;
+    std::vector<uint64_t> ids;
+    uint64_t next = 0, active = 0;
+    if (width == 0) {
+        width = 1;
+    }
+    for (; next < n && next < width; next++, active++) {
+        slots.push_back(make_lookup(next));
+        ids.push_back(next);
+    }
+    while (active != 0) {
+        for (uint64_t s = 0; s < slots.size(); s++) {
+            if (ids[s] == n) { // slot drained
+                continue;
+            }
+            slots[s].resume();
+            if (!slots[s].done()) {
+                continue;
+            }
+            on_result(ids[s], slots[s].result());
+            if (next < n) {
+                slots[s] = make_lookup(next);
+                ids[s] = next++;
+            } else {
+                ids[s] = n;
+                active--;
+            }
+        }
+    }
+}
+
+#endif /* END LOOKUP_TASK_HPP__ */
@@ -1,134 +1,352 @@
 #include "map_of_bitset.h"
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Keys looked up per coordinate_table_get_many call by the batched lookups
+#define MAP_LOOKUP_BLOCK 256
 
 collection make_2d(uint16_t d1, uint16_t d2) {
-    collection c;
-    c.index = malloc(2 * sizeof(uint16_t));
-    c.index[0] = d1;
-    c.index[1] = d2;
-    return c;
+    return (collection) d1 | ((collection) d2 << 16);
 }
 
 collection make_3d(uint16_t d1, uint16_t d2, uint16_t d3) {
-    collection c;
-    c.index = malloc(3 * sizeof(uint16_t));
-    c.index[0] = d1;
-    c.index[1] = d2;
-    c.index[2] = d3;
-    return c;
+    return (collection) d1 | ((collection) d2 << 16) | ((collection) d3 << 32);
+}
+
+void update_2d(collection *c, uint16_t d1, uint16_t d2) {
+    *c = make_2d(d1, d2);
 }
 
-void update_2d(collection c, uint16_t d1, uint16_t d2) {
-    c.index[0] = d1;
-    c.index[1] = d2;
+void update_3d(collection *c, uint16_t d1, uint16_t d2, uint16_t d3) {
+    *c = make_3d(d1, d2, d3);
 }
 
-void update_3d(collection c, uint16_t d1, uint16_t d2, uint16_t d3) {
-    c.index[0] = d1;
-    c.index[1] = d2;
-    c.index[2] = d3;
+uint16_t get_dim(collection c, map_key_n_dims dim) {
+    return (uint16_t) (c >> (16 * dim));
 }
 
 void free_collection(collection c) {
-    free(c.index);
-}
-
-static uint64_t map_key_hash(void *_key, void *_global) {
-    map_key *key = _key;
-    map_key_n_dims *n_dims = _global;
-    uint32_t n_bytes = *n_dims * sizeof(key->index[0]);
-    uint8_t *bytes = (uint8_t *) key->index;
-    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
-    uint64_t h = 14695981039346656073ULL; // FNV_OFFSET 64 bit
-    for (uint32_t i = 0; i < n_bytes; i++){
-        h = h ^ bytes[i];
-        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
-    }
-    return h;
-}
-
-static int map_key_equals(void *_key_1, void *_key_2, void *_global) {
-    map_key *key_1 = _key_1;
-    map_key *key_2 = _key_2;
-    map_key_n_dims *n_dims = _global;
-    for (uint32_t i = 0; i < *n_dims; i++) {
-        if (key_1->index[i] != key_2->index[i]) {
-            return 0;
-        }
-    }
-    return 1;
+    (void) c;
+}
+
+// The table indexes with the low bits of the hash, which for a packed key
+// would only see the first coordinate; fold every coordinate into them
+static inline uint64_t map_key_hash(map_key key) {
+    return set_hash_coordinates(key);
 }
 
-static void *map_key_copy(void *_key, void *_global) {
-    map_key *key = _key;
-    map_key *copy = malloc(sizeof(map_key));
-    map_key_n_dims *n_dims = _global;
-    uint32_t n_bytes = *n_dims * sizeof(uint16_t);
-    copy->index = malloc(n_bytes);
-    memcpy(copy->index, key->index, n_bytes);
-    return copy;
+static inline int map_key_equals(map_key key_1, map_key key_2) {
+    return key_1 == key_2;
+}
+
+TYPED_HASH_MAP_IMPL(coordinate_table, map_key, label_bitset, map_key_hash, map_key_equals)
+
+coordinate_map *init_map(map_key_n_dims *n_dims, uint64_t init_size) {
+    return init_map_hash(n_dims, init_size, NULL);
 }
 
-static void map_key_free(void *_key, void *_global) {
-    use(_global);
-    map_key *key = _key;
-    free(key->index);
-    free(key);
+// Set up the table of a map already allocated; SET_TRUE, SET_FALSE for bad
+// arguments or SET_MALLOC_ERROR
+static int init_map_table(coordinate_map *map, map_key_n_dims *n_dims, uint64_t init_size, const char *hash_name) {
+    set_int_hash_function hash = set_int_hash_by_name(hash_name);
+    if (*n_dims > MAP_KEY_MAX_DIMS || (hash_name != NULL && hash == NULL)) {
+        return SET_FALSE;
+    }
+    if (hash == set_hash_coordinates) {
+        hash = NULL;  // the table inlines map_key_hash
+    }
+    if (coordinate_table_init_hash(&map->table, init_size, hash) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
+    map->n_dims = *n_dims;
+    return SET_TRUE;
 }
 
-SimpleSet *init_map(map_key_n_dims *n_dims, uint64_t init_size) {
-    SimpleSet *map = malloc(sizeof(SimpleSet));
-    set_init(map, n_dims, init_size, map_key_hash, map_key_equals, map_key_copy, map_key_free);
+coordinate_map *init_map_hash(map_key_n_dims *n_dims, uint64_t init_size, const char *hash_name) {
+    coordinate_map *map = malloc(sizeof(coordinate_map));
+    if (map == NULL) {
+        return NULL;
+    }
+    if (init_map_table(map, n_dims, init_size, hash_name) != SET_TRUE) {
+        free(map);
+        return NULL;
+    }
     return map;
 }
 
-int add_item(SimpleSet *map, map_key key, uint32_t label) {
-    if (label >= 32) {
-        printf("Labels limited to values between 0 and 32");
+void destroy_map(coordinate_map *map) {
+    coordinate_table_destroy(&map->table);
+    free(map);
+}
+
+void clear_map(coordinate_map *map) {
+    coordinate_table_clear(&map->table);
+}
+
+uint64_t map_length(coordinate_map *map) {
+    return coordinate_table_length(&map->table);
+}
+
+int add_item(coordinate_map *map, map_key key, uint32_t label) {
+    if (label >= MAP_LABEL_BITS) {
+        return -1;
     }
-    int result = set_contains(map, &key);
-    if (result == SET_FALSE) {
-        uint32_t *label_set = malloc(sizeof(uint32_t));
-        *label_set = 1 << label;
-        set_add_with_data(map, &key, label_set);
-        return 1;
+    int added;
+    // a new key starts with an empty label set
+    label_bitset *label_set = coordinate_table_put(&map->table, key, &added);
+    if (label_set == NULL) {
+        return -1;
     }
-    uint32_t *label_set;
-    set_get_data(map, &key, (void **) &label_set);
-    if (*label_set & (1 << label)) {
+    uint64_t bit = (uint64_t) 1 << (label % 64);
+    if (label_set->words[label / 64] & bit) {
         return 0;
     }
-    *label_set |= (1 << label);
+    label_set->words[label / 64] |= bit;
     return 1;
 }
 
-static uint32_t count_set_bits(int n) {
+void add_items(coordinate_map *map, const map_key *keys, const uint32_t *labels, uint64_t n, int *results) {
+    // if reserving fails add_item still grows the map as needed
+    coordinate_table_reserve(&map->table, n);
+    for (uint64_t i = 0; i < n; i++) {
+        if (i + TYPED_HASH_MAP_PREFETCH_DISTANCE < n) {
+            coordinate_table_prefetch(&map->table, keys[i + TYPED_HASH_MAP_PREFETCH_DISTANCE]);
+        }
+        int res = add_item(map, keys[i], labels[i]);
+        if (results != NULL) {
+            results[i] = res;
+        }
+    }
+}
+
+static uint32_t count_set_bits(const label_bitset *label_set) {
+#if defined(__AVX2__) && MAP_LABEL_WORDS % 4 == 0
+    // nibble lookup popcount 256 bits at a time, summed per 64 bit lane
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    for (uint32_t i = 0; i < MAP_LABEL_WORDS; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) &label_set->words[i]);
+        __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_nibbles));
+        __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    return (uint32_t) (_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                       _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3));
+#else
     uint32_t count = 0;
-    while (n) {
-        n &= (n - 1);
-        count++;
+    for (uint32_t i = 0; i < MAP_LABEL_WORDS; i++) {
+        count += __builtin_popcountll(label_set->words[i]);
     }
     return count;
+#endif
 }
 
-int get_labels(SimpleSet *map, map_key key, uint32_t **labels, uint32_t *n_labels) {
-    uint32_t *label_set;
-    if (set_get_data(map, &key, (void **) &label_set) == SET_TRUE) {
-        *n_labels = count_set_bits(*label_set);
-        *labels = malloc(*n_labels * sizeof(uint32_t));
-        uint32_t j = 0;
-        for (int i = 0; i < 32; i++) {
-            if (*label_set & (1 << i)) {
-                (*labels)[j++] = i;
+// Write the first max_labels labels of label_set to labels
+static void extract_labels(const label_bitset *label_set, uint32_t *labels, uint32_t max_labels) {
+    uint32_t j = 0;
+    for (uint32_t i = 0; i < MAP_LABEL_WORDS; i++) {
+        // visit only the set bits, lowest first
+        uint64_t word = label_set->words[i];
+        while (word) {
+            if (j == max_labels) {
+                return;
             }
+            labels[j++] = i * 64 + __builtin_ctzll(word);
+            word &= word - 1;
         }
+    }
+}
+
+int get_labels(coordinate_map *map, map_key key, uint32_t **labels, uint32_t *n_labels) {
+    label_bitset *label_set = coordinate_table_get(&map->table, key);
+    if (label_set != NULL) {
+        *n_labels = count_set_bits(label_set);
+        *labels = malloc(*n_labels * sizeof(uint32_t));
+        extract_labels(label_set, *labels, *n_labels);
+        return 1;
+    }
+    return 0;
+}
+
+int get_labels_into(coordinate_map *map, map_key key, uint32_t *labels, uint32_t max_labels, uint32_t *n_labels) {
+    label_bitset *label_set = coordinate_table_get(&map->table, key);
+    if (label_set != NULL) {
+        *n_labels = count_set_bits(label_set);
+        extract_labels(label_set, labels, max_labels);
         return 1;
     }
+    *n_labels = 0;
     return 0;
 }
 
-map_key **get_keys(SimpleSet *map, uint64_t *n_keys) {
-    return (map_key **) set_to_array(map, n_keys);
+label_bitset get_label_mask(coordinate_map *map, map_key key) {
+    label_bitset *label_set = coordinate_table_get(&map->table, key);
+    if (label_set != NULL) {
+        return *label_set;
+    }
+    label_bitset empty;
+    memset(&empty, 0, sizeof(empty));
+    return empty;
+}
+
+int visit_labels(coordinate_map *map, map_key key, label_visitor visit, void *context) {
+    label_bitset *label_set = coordinate_table_get(&map->table, key);
+    if (label_set == NULL) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < MAP_LABEL_WORDS; i++) {
+        uint64_t word = label_set->words[i];
+        while (word) {
+            visit(i * 64 + __builtin_ctzll(word), context);
+            word &= word - 1;
+        }
+    }
+    return 1;
+}
+
+void contains_items(coordinate_map *map, const map_key *keys, uint64_t n, int *results) {
+    label_bitset *found[MAP_LOOKUP_BLOCK];
+    for (uint64_t start = 0; start < n; start += MAP_LOOKUP_BLOCK) {
+        uint64_t m = (n - start < MAP_LOOKUP_BLOCK) ? n - start : MAP_LOOKUP_BLOCK;
+        coordinate_table_get_many(&map->table, keys + start, m, found);
+        for (uint64_t i = 0; i < m; i++) {
+            results[start + i] = (found[i] != NULL);
+        }
+    }
+}
+
+void get_label_masks(coordinate_map *map, const map_key *keys, uint64_t n, label_bitset *masks) {
+    label_bitset *found[MAP_LOOKUP_BLOCK];
+    for (uint64_t start = 0; start < n; start += MAP_LOOKUP_BLOCK) {
+        uint64_t m = (n - start < MAP_LOOKUP_BLOCK) ? n - start : MAP_LOOKUP_BLOCK;
+        coordinate_table_get_many(&map->table, keys + start, m, found);
+        for (uint64_t i = 0; i < m; i++) {
+            if (found[i] != NULL) {
+                masks[start + i] = *found[i];
+            } else {
+                memset(&masks[start + i], 0, sizeof(label_bitset));
+            }
+        }
+    }
+}
+
+map_key *get_keys(coordinate_map *map, uint64_t *n_keys) {
+    map_key *keys = malloc(map->table.used_nodes * sizeof(map_key));
+    uint64_t j = 0;
+    for (uint64_t i = 0; i < map->table.number_nodes; i++) {
+        if (coordinate_table_slot_used(&map->table, i)) {
+            keys[j++] = map->table.nodes[i]._key;
+        }
+    }
+    *n_keys = j;
+    return keys;
+}
+
+void visit_keys(coordinate_map *map, key_visitor visit, void *context) {
+    for (uint64_t i = 0; i < map->table.number_nodes; i++) {
+        if (coordinate_table_slot_used(&map->table, i)) {
+            visit(map->table.nodes[i]._key, context);
+        }
+    }
+}
+
+uint64_t map_intersection_count(coordinate_map *a, coordinate_map *b) {
+    return coordinate_table_count_common(&a->table, &b->table);
+}
+
+uint64_t map_union_count(coordinate_map *a, coordinate_map *b) {
+    return map_length(a) + map_length(b) - map_intersection_count(a, b);
+}
+
+uint64_t map_difference_count(coordinate_map *a, coordinate_map *b) {
+    return map_length(a) - map_intersection_count(a, b);
+}
+
+concurrent_coordinate_map *init_concurrent_map(map_key_n_dims *n_dims, uint64_t init_size, uint32_t n_shards) {
+    uint32_t i, bits = 0;
+    if (*n_dims > MAP_KEY_MAX_DIMS) {
+        return NULL;
+    }
+    if (n_shards == 0) {
+        n_shards = MAP_SHARDS;
+    }
+    while (((uint64_t) 1 << bits) < n_shards) {
+        bits++;
+    }
+    concurrent_coordinate_map *map = malloc(sizeof(concurrent_coordinate_map));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->n_shards = (uint32_t) 1 << bits;
+    map->shard_bits = bits;
+    map->n_dims = *n_dims;
+    map->shards = aligned_alloc(64, map->n_shards * sizeof(coordinate_map_shard));
+    if (map->shards == NULL) {
+        free(map);
+        return NULL;
+    }
+    for (i = 0; i < map->n_shards; i++) {
+        if (init_map_table(&map->shards[i].map, n_dims, init_size / map->n_shards, NULL) != SET_TRUE) {
+            while (i-- > 0) {
+                coordinate_table_destroy(&map->shards[i].map.table);
+                pthread_mutex_destroy(&map->shards[i].lock);
+            }
+            free(map->shards);
+            free(map);
+            return NULL;
+        }
+        pthread_mutex_init(&map->shards[i].lock, NULL);
+    }
+    return map;
+}
+
+void destroy_concurrent_map(concurrent_coordinate_map *map) {
+    for (uint32_t i = 0; i < map->n_shards; i++) {
+        coordinate_table_destroy(&map->shards[i].map.table);
+        pthread_mutex_destroy(&map->shards[i].lock);
+    }
+    free(map->shards);
+    free(map);
+}
+
+// The shards' tables index with the low bits of map_key_hash, whose high bits
+// are the poorly mixed low bits of its product; remix before taking the top
+// bits, as ConcurrentSet does, so the shard says nothing about the slot
+static coordinate_map_shard *get_shard(concurrent_coordinate_map *map, map_key key) {
+    if (map->shard_bits == 0) {
+        return &map->shards[0];
+    }
+    return &map->shards[set_hash_murmur3(map_key_hash(key)) >> (64 - map->shard_bits)];
+}
+
+uint64_t concurrent_map_length(concurrent_coordinate_map *map) {
+    uint64_t length = 0;
+    for (uint32_t i = 0; i < map->n_shards; i++) {
+        pthread_mutex_lock(&map->shards[i].lock);
+        length += map_length(&map->shards[i].map);
+        pthread_mutex_unlock(&map->shards[i].lock);
+    }
+    return length;
+}
+
+int concurrent_add_item(concurrent_coordinate_map *map, map_key key, uint32_t label) {
+    coordinate_map_shard *shard = get_shard(map, key);
+    pthread_mutex_lock(&shard->lock);
+    int res = add_item(&shard->map, key, label);
+    pthread_mutex_unlock(&shard->lock);
+    return res;
+}
+
+label_bitset concurrent_get_label_mask(concurrent_coordinate_map *map, map_key key) {
+    coordinate_map_shard *shard = get_shard(map, key);
+    pthread_mutex_lock(&shard->lock);
+    label_bitset mask = get_label_mask(&shard->map, key);
+    pthread_mutex_unlock(&shard->lock);
+    return mask;
 }
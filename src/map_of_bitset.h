@@ -1,16 +1,70 @@
 #ifndef __MAP_OF_SET_OF_INT_H
 #define __MAP_OF_SET_OF_INT_H
 
-#include "hash_map.h"
+#include <pthread.h>
+#include "typed_hash_map.h"
+#include "set_hash.h"
 
-// A key consisting of a number of "coordinates"
-typedef struct map_key {
-    // The values of the coordinates
-    uint16_t *index;
-} map_key;
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef uint16_t map_key_n_dims;
 
+// The most coordinates a key can have
+#define MAP_KEY_MAX_DIMS 4
+
+// A key consisting of a number of "coordinates", packed into one integer with
+// coordinate i in bits 16 * i to 16 * i + 15
+typedef uint64_t map_key;
+
+// How many labels a key can hold; labels run from 0 to MAP_LABEL_BITS - 1.
+// Override at compile time with -DMAP_LABEL_BITS=n where n is a multiple of 64
+#ifndef MAP_LABEL_BITS
+#define MAP_LABEL_BITS 256
+#endif
+
+#if MAP_LABEL_BITS <= 0 || MAP_LABEL_BITS % 64 != 0
+#error "MAP_LABEL_BITS must be a positive multiple of 64"
+#endif
+
+#define MAP_LABEL_WORDS (MAP_LABEL_BITS / 64)
+
+// The labels of a key, bit label % 64 of word label / 64
+typedef struct label_bitset {
+    uint64_t words[MAP_LABEL_WORDS];
+} label_bitset;
+
+// Each key stores its labels inline as a bitset
+TYPED_HASH_MAP_DECLARE(coordinate_table, map_key, label_bitset)
+
+// A map from keys to their labels
+typedef struct coordinate_map {
+    coordinate_table table;
+    map_key_n_dims n_dims;
+} coordinate_map;
+
+// Shards used when init_concurrent_map is given 0
+#define MAP_SHARDS 64
+
+// One independently locked part of a concurrent_coordinate_map, cache line
+// aligned so that neighbouring locks do not share a line
+typedef struct coordinate_map_shard {
+    pthread_mutex_t lock;
+    coordinate_map map;
+} __attribute__((aligned(64))) coordinate_map_shard;
+
+// A map split into shards by the top shard_bits bits of the key's hash
+// remixed with set_hash_murmur3 (the same scheme as ConcurrentSet), so that
+// threads adding items only wait on each other when their keys land in
+// the same shard
+typedef struct concurrent_coordinate_map {
+    coordinate_map_shard *shards;
+    uint32_t n_shards;
+    uint32_t shard_bits;
+    map_key_n_dims n_dims;
+} concurrent_coordinate_map;
+
 // Rename to collection for convenience
 typedef map_key collection;
 
@@ -21,29 +75,114 @@ collection make_2d(uint16_t d1, uint16_t d2);
 collection make_3d(uint16_t d1, uint16_t d2, uint16_t d3);
 
 // Update a 2D key
-void update_2d(collection c, uint16_t d1, uint16_t d2);
+void update_2d(collection *c, uint16_t d1, uint16_t d2);
 
 // Update a 3D key
-void update_3d(collection c, uint16_t d1, uint16_t d2, uint16_t d3);
+void update_3d(collection *c, uint16_t d1, uint16_t d2, uint16_t d3);
+
+// Get coordinate dim of a key
+uint16_t get_dim(collection c, map_key_n_dims dim);
 
-// Free a previously made collection
+// Free a previously made collection; keys no longer own any memory so this
+// is a no-op kept for compatibility
 void free_collection(collection c);
 
 // Create a new Map instance
-SimpleSet *init_map(map_key_n_dims *n_dims, uint64_t init_size);
+// Returns NULL if n_dims is more than MAP_KEY_MAX_DIMS or on malloc failure
+coordinate_map *init_map(map_key_n_dims *n_dims, uint64_t init_size);
+
+// Create a new Map instance that hashes keys with the set_hash.h integer hash
+// called hash_name (NULL for the default, "coordinates")
+// Returns NULL if hash_name is unknown, n_dims is more than MAP_KEY_MAX_DIMS
+// or on malloc failure
+coordinate_map *init_map_hash(map_key_n_dims *n_dims, uint64_t init_size, const char *hash_name);
+
+// Free the map
+void destroy_map(coordinate_map *map);
+
+// Remove every key in O(1), keeping the table for the next frame
+void clear_map(coordinate_map *map);
+
+// Number of keys in the map
+uint64_t map_length(coordinate_map *map);
 
 // Add an item to the map and associate it with a label
-// Returns 1 if the item was new, or 0 if it already existed
-int add_item(SimpleSet *map, map_key key, uint32_t label);
+// Returns 1 if the item was new, 0 if it already existed, or -1 if label is
+// not less than MAP_LABEL_BITS or on malloc failure
+int add_item(coordinate_map *map, map_key key, uint32_t label);
+
+// Add keys[i] with labels[i] for each of the n items at once, growing the map
+// a single time and prefetching upcoming keys. If results is not NULL,
+// results[i] receives what add_item would have returned for item i
+void add_items(coordinate_map *map, const map_key *keys, const uint32_t *labels, uint64_t n, int *results);
 
 // Get the labels currently assigned to the given coordinates
 // labels is a pointer to a list of labels to be filled in.
 // n_labels is a pointer to how many labels there are.
 // Returns 1 if there are any labels at all, or 0 if there are none (in which
 // case *labels will be invalid)
-int get_labels(SimpleSet *map, map_key key, uint32_t **labels, uint32_t *n_labels);
+int get_labels(coordinate_map *map, map_key key, uint32_t **labels, uint32_t *n_labels);
+
+// Get the labels currently assigned to the given coordinates without
+// allocating. Up to max_labels labels are written to labels in ascending
+// order and n_labels is set to how many labels the key has, which may be more
+// than max_labels. Returns 1 if the key is in the map, or 0 if it is not
+int get_labels_into(coordinate_map *map, map_key key, uint32_t *labels, uint32_t max_labels, uint32_t *n_labels);
+
+// Get the label bitset of the given coordinates; empty if the key is not in
+// the map
+label_bitset get_label_mask(coordinate_map *map, map_key key);
+
+// Called once for each label of a key by visit_labels
+typedef void (*label_visitor)(uint32_t label, void *context);
+
+// Call visit(label, context) for each label of the given coordinates in
+// ascending order. Returns 1 if the key is in the map, or 0 if it is not
+int visit_labels(coordinate_map *map, map_key key, label_visitor visit, void *context);
+
+// Check n keys at once, prefetching ahead; results[i] is 1 if keys[i] is in
+// the map and 0 if not
+void contains_items(coordinate_map *map, const map_key *keys, uint64_t n, int *results);
+
+// Get the label bitsets of n keys at once, prefetching ahead; masks[i] is
+// empty if keys[i] is not in the map
+void get_label_masks(coordinate_map *map, const map_key *keys, uint64_t n, label_bitset *masks);
+
+// Get the non-empty keys in the map; the caller frees the returned array
+map_key *get_keys(coordinate_map *map, uint64_t *n_keys);
+
+// Called once for each key of the map by visit_keys
+typedef void (*key_visitor)(map_key key, void *context);
+
+// Call visit(key, context) for each key in the map without allocating
+void visit_keys(coordinate_map *map, key_visitor visit, void *context);
+
+// Number of keys in both a and b, in either, and in a but not b; the keys of
+// the smaller map are looked up in the other and nothing is allocated
+uint64_t map_intersection_count(coordinate_map *a, coordinate_map *b);
+uint64_t map_union_count(coordinate_map *a, coordinate_map *b);
+uint64_t map_difference_count(coordinate_map *a, coordinate_map *b);
+
+// Create a map that any number of threads can use at once, split into
+// n_shards shards (rounded up to a power of two, 0 for MAP_SHARDS) holding
+// init_size keys between them before growing
+// Returns NULL if n_dims is more than MAP_KEY_MAX_DIMS or on malloc failure
+concurrent_coordinate_map *init_concurrent_map(map_key_n_dims *n_dims, uint64_t init_size, uint32_t n_shards);
+
+// Free the map; no thread may be using it
+void destroy_concurrent_map(concurrent_coordinate_map *map);
+
+// Number of keys in the map; only exact while no thread is adding
+uint64_t concurrent_map_length(concurrent_coordinate_map *map);
+
+// add_item for a concurrent map; locks only the key's shard
+int concurrent_add_item(concurrent_coordinate_map *map, map_key key, uint32_t label);
+
+// get_label_mask for a concurrent map; locks only the key's shard
+label_bitset concurrent_get_label_mask(concurrent_coordinate_map *map, map_key key);
 
-// Get the non-empty keys in the map
-map_key **get_keys(SimpleSet *map, uint64_t *n_keys);
+#ifdef __cplusplus
+} // extern "C"
+#endif
 
 #endif // __MAP_OF_SET_OF_INT_H
@@ -0,0 +1,45 @@
+/*******************************************************************************
+***
+***     Coroutine lookups for map_of_bitset
+***
+***     Purpose: Label lookups as lookup_task coroutines that suspend after
+***              prefetching the key's slot; run them with interleave()
+***
+***     License: MIT 2016
+***
+*******************************************************************************/
+
+#ifndef MAP_OF_BITSET_CORO_HPP__
+#define MAP_OF_BITSET_CORO_HPP__
+
+#include <cstring>
+
+#include "map_of_bitset.h"
+#include "lookup_task.hpp"
+
+namespace map_coro {
+
+/*  1 if key is in the map, 0 if not */
+inline lookup_task<int> contains(coordinate_map *map, map_key key) {
+    coordinate_table_prefetch(&map->table, key);
+    co_await std::suspend_always();
+    co_return coordinate_table_get(&map->table, key) != NULL;
+}
+
+/*  Same result as get_label_mask(map, key) */
+inline lookup_task<label_bitset> label_mask(coordinate_map *map, map_key key) {
+    label_bitset mask;
+    coordinate_table_prefetch(&map->table, key);
+    co_await std::suspend_always();
+    label_bitset *found = coordinate_table_get(&map->table, key);
+    if (found != NULL) {
+        mask = *found;
+    } else {
+        std::memset(&mask, 0, sizeof(mask));
+    }
+    co_return mask;
+}
+
+} // namespace map_coro
+
+#endif /* END MAP_OF_BITSET_CORO_HPP__ */
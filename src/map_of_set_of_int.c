@@ -2,141 +2,371 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Keys looked up per coordinate_table_get_many call by the batched lookups
+#define MAP_LOOKUP_BLOCK 256
+
 collection make_2d(uint16_t d1, uint16_t d2) {
-    collection c;
-    c.index = malloc(2 * sizeof(uint16_t));
-    c.index[0] = d1;
-    c.index[1] = d2;
-    return c;
+    return (collection) d1 | ((collection) d2 << 16);
 }
 
 collection make_3d(uint16_t d1, uint16_t d2, uint16_t d3) {
-    collection c;
-    c.index = malloc(3 * sizeof(uint16_t));
-    c.index[0] = d1;
-    c.index[1] = d2;
-    c.index[2] = d3;
-    return c;
+    return (collection) d1 | ((collection) d2 << 16) | ((collection) d3 << 32);
+}
+
+uint16_t get_dim(collection c, map_key_n_dims dim) {
+    return (uint16_t) (c >> (16 * dim));
 }
 
 void free_collection(collection c) {
-    free(c.index);
+    (void) c;
+}
+
+// The table indexes with the low bits of the hash, which for a packed key
+// would only see the first coordinate; fold every coordinate into them
+static inline uint64_t map_key_hash(map_key key) {
+    return set_hash_coordinates(key);
+}
+
+static inline int map_key_equals(map_key key_1, map_key key_2) {
+    return key_1 == key_2;
+}
+
+TYPED_HASH_MAP_IMPL(coordinate_table, map_key, label_list, map_key_hash, map_key_equals)
+
+static inline uint64_t label_hash(uint32_t label) {
+    return set_hash_int(label);
+}
+
+static inline int label_equals(uint32_t label_1, uint32_t label_2) {
+    return label_1 == label_2;
 }
 
-static uint64_t map_key_hash(void *_key, void *_global) {
-    map_key *key = _key;
-    map_key_n_dims *n_dims = _global;
-    uint32_t n_bytes = *n_dims * sizeof(key->index[0]);
-    uint8_t *bytes = (uint8_t *) key->index;
-    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
-    uint64_t h = 14695981039346656073ULL; // FNV_OFFSET 64 bit
-    for (uint32_t i = 0; i < n_bytes; i++){
-        h = h ^ bytes[i];
-        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
+TYPED_HASH_MAP_IMPL(label_table, uint32_t, uint8_t, label_hash, label_equals)
+
+// Move the inline labels of a full list to a new label_table
+static int promote_labels(label_list *list) {
+    label_table *table = malloc(sizeof(label_table));
+    if (table == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    if (label_table_init(table, 2 * MAP_INLINE_LABELS) != SET_TRUE) {
+        free(table);
+        return SET_MALLOC_ERROR;
+    }
+    int added;
+    for (uint32_t i = 0; i < MAP_INLINE_LABELS; i++) {
+        label_table_put(table, list->labels.values[i], &added);
+    }
+    list->labels.table = table;
+    return SET_TRUE;
+}
+
+// Write up to max_labels labels of list to labels
+static void copy_labels(const label_list *list, uint32_t *labels, uint64_t max_labels) {
+    uint64_t j = 0;
+    if (list->n_labels <= MAP_INLINE_LABELS) {
+        for (uint32_t i = 0; i < list->n_labels && j < max_labels; i++) {
+            labels[j++] = list->labels.values[i];
+        }
+        return;
+    }
+    label_table *table = list->labels.table;
+    for (uint64_t i = 0; i < table->number_nodes && j < max_labels; i++) {
+        if (label_table_slot_used(table, i)) {
+            labels[j++] = table->nodes[i]._key;
+        }
     }
-    return h;
 }
 
-static int map_key_equals(void *_key_1, void *_key_2, void *_global) {
-    map_key *key_1 = _key_1;
-    map_key *key_2 = _key_2;
-    map_key_n_dims *n_dims = _global;
-    for (uint32_t i = 0; i < *n_dims; i++) {
-        if (key_1->index[i] != key_2->index[i]) {
+coordinate_map *init_map(map_key_n_dims *n_dims, uint64_t init_size) {
+    return init_map_hash(n_dims, init_size, NULL);
+}
+
+// Set up the table of a map already allocated; SET_TRUE, SET_FALSE for bad
+// arguments or SET_MALLOC_ERROR
+static int init_map_table(coordinate_map *map, map_key_n_dims *n_dims, uint64_t init_size, const char *hash_name) {
+    set_int_hash_function hash = set_int_hash_by_name(hash_name);
+    if (*n_dims > MAP_KEY_MAX_DIMS || (hash_name != NULL && hash == NULL)) {
+        return SET_FALSE;
+    }
+    if (hash == set_hash_coordinates) {
+        hash = NULL;  // the table inlines map_key_hash
+    }
+    if (coordinate_table_init_hash(&map->table, init_size, hash) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
+    map->n_dims = *n_dims;
+    return SET_TRUE;
+}
+
+coordinate_map *init_map_hash(map_key_n_dims *n_dims, uint64_t init_size, const char *hash_name) {
+    coordinate_map *map = malloc(sizeof(coordinate_map));
+    if (map == NULL) {
+        return NULL;
+    }
+    if (init_map_table(map, n_dims, init_size, hash_name) != SET_TRUE) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+// Free the table of a map and the label sets in it, but not the map itself
+static void destroy_map_table(coordinate_map *map) {
+    for (uint64_t i = 0; i < map->table.number_nodes; i++) {
+        label_list *list = &map->table.nodes[i]._data;
+        if (coordinate_table_slot_used(&map->table, i) && list->n_labels > MAP_INLINE_LABELS) {
+            label_table_destroy(list->labels.table);
+            free(list->labels.table);
+        }
+    }
+    coordinate_table_destroy(&map->table);
+}
+
+void destroy_map(coordinate_map *map) {
+    destroy_map_table(map);
+    free(map);
+}
+
+uint64_t map_length(coordinate_map *map) {
+    return coordinate_table_length(&map->table);
+}
+
+int add_item(coordinate_map *map, map_key key, uint32_t label) {
+    int added;
+    // a new key starts with an empty label list
+    label_list *list = coordinate_table_put(&map->table, key, &added);
+    if (list == NULL) {
+        return -1;
+    }
+    if (list->n_labels <= MAP_INLINE_LABELS) {
+        uint32_t *values = list->labels.values;
+        uint32_t i = 0;
+        while (i < list->n_labels && values[i] < label) {
+            i++;
+        }
+        if (i < list->n_labels && values[i] == label) {
             return 0;
         }
+        if (list->n_labels < MAP_INLINE_LABELS) {
+            memmove(&values[i + 1], &values[i], (list->n_labels - i) * sizeof(uint32_t));
+            values[i] = label;
+            list->n_labels++;
+            return 1;
+        }
+        if (promote_labels(list) != SET_TRUE) {
+            return -1;
+        }
+    }
+    if (label_table_put(list->labels.table, label, &added) == NULL) {
+        return -1;
+    }
+    if (!added) {
+        return 0;
+    }
+    list->n_labels++;
+    return 1;
+}
+
+void add_items(coordinate_map *map, const map_key *keys, const uint32_t *labels, uint64_t n, int *results) {
+    // if reserving fails add_item still grows the map as needed
+    coordinate_table_reserve(&map->table, n);
+    for (uint64_t i = 0; i < n; i++) {
+        if (i + TYPED_HASH_MAP_PREFETCH_DISTANCE < n) {
+            coordinate_table_prefetch(&map->table, keys[i + TYPED_HASH_MAP_PREFETCH_DISTANCE]);
+        }
+        int res = add_item(map, keys[i], labels[i]);
+        if (results != NULL) {
+            results[i] = res;
+        }
     }
+}
+
+int get_labels(coordinate_map *map, map_key key, uint32_t ***labels, uint64_t *n_labels) {
+    label_list *list = coordinate_table_get(&map->table, key);
+    if (list == NULL) {
+        return 0;
+    }
+    uint32_t *values = malloc(list->n_labels * sizeof(uint32_t));
+    copy_labels(list, values, list->n_labels);
+    *n_labels = list->n_labels;
+    *labels = malloc(list->n_labels * sizeof(uint32_t *));
+    for (uint64_t i = 0; i < list->n_labels; i++) {
+        (*labels)[i] = malloc(sizeof(uint32_t));
+        *(*labels)[i] = values[i];
+    }
+    free(values);
     return 1;
 }
 
-static void *map_key_copy(void *_key, void *_global) {
-    map_key *key = _key;
-    map_key_n_dims *n_dims = _global;
-    map_key *copy = malloc(sizeof(map_key));
-    uint32_t n_bytes = *n_dims * sizeof(uint16_t);
-    copy->index = malloc(n_bytes);
-    memcpy(copy->index, key->index, n_bytes);
-    return copy;
+int get_labels_into(coordinate_map *map, map_key key, uint32_t *labels, uint64_t max_labels, uint64_t *n_labels) {
+    label_list *list = coordinate_table_get(&map->table, key);
+    if (list == NULL) {
+        *n_labels = 0;
+        return 0;
+    }
+    copy_labels(list, labels, max_labels);
+    *n_labels = list->n_labels;
+    return 1;
 }
 
-static void map_key_free(void *_key, void *_global) {
-    use(_global);
-    map_key *key = _key;
-    free(key->index);
-    free(key);
+const label_list *get_label_list(coordinate_map *map, map_key key) {
+    return coordinate_table_get(&map->table, key);
 }
 
-typedef uint32_t set_key;
+int visit_labels(coordinate_map *map, map_key key, label_visitor visit, void *context) {
+    label_list *list = coordinate_table_get(&map->table, key);
+    if (list == NULL) {
+        return 0;
+    }
+    if (list->n_labels <= MAP_INLINE_LABELS) {
+        for (uint32_t i = 0; i < list->n_labels; i++) {
+            visit(list->labels.values[i], context);
+        }
+        return 1;
+    }
+    label_table *table = list->labels.table;
+    for (uint64_t i = 0; i < table->number_nodes; i++) {
+        if (label_table_slot_used(table, i)) {
+            visit(table->nodes[i]._key, context);
+        }
+    }
+    return 1;
+}
 
-static uint64_t set_key_hash(void *_key, void *_global) {
-    use(_global);
-    set_key *key = _key;
-    uint32_t n_bytes = sizeof(set_key);
-    uint8_t *bytes = (uint8_t *) key;
-    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
-    uint64_t h = 14695981039346656073ULL; // FNV_OFFSET 64 bit
-    for (uint32_t i = 0; i < n_bytes; i++) {
-        h = h ^ bytes[i];
-        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
+void contains_items(coordinate_map *map, const map_key *keys, uint64_t n, int *results) {
+    label_list *found[MAP_LOOKUP_BLOCK];
+    for (uint64_t start = 0; start < n; start += MAP_LOOKUP_BLOCK) {
+        uint64_t m = (n - start < MAP_LOOKUP_BLOCK) ? n - start : MAP_LOOKUP_BLOCK;
+        coordinate_table_get_many(&map->table, keys + start, m, found);
+        for (uint64_t i = 0; i < m; i++) {
+            results[start + i] = (found[i] != NULL);
+        }
     }
-    return h;
 }
 
-static int set_key_equals(void *_key_1, void *_key_2, void *_global) {
-    use(_global);
-    set_key *key_1 = _key_1;
-    set_key *key_2 = _key_2;
-    if (*key_1 == *key_2) {
-        return 1;
+void get_label_lists(coordinate_map *map, const map_key *keys, uint64_t n, const label_list **lists) {
+    label_list *found[MAP_LOOKUP_BLOCK];
+    for (uint64_t start = 0; start < n; start += MAP_LOOKUP_BLOCK) {
+        uint64_t m = (n - start < MAP_LOOKUP_BLOCK) ? n - start : MAP_LOOKUP_BLOCK;
+        coordinate_table_get_many(&map->table, keys + start, m, found);
+        for (uint64_t i = 0; i < m; i++) {
+            lists[start + i] = found[i];
+        }
     }
-    return 0;
 }
 
-static void *set_key_copy(void *_key, void *_global) {
-    use(_global);
-    set_key *key = _key;
-    set_key *copy = malloc(sizeof(set_key));
-    *copy = *key;
-    return copy;
+map_key *get_keys(coordinate_map *map, uint64_t *n_keys) {
+    map_key *keys = malloc(map->table.used_nodes * sizeof(map_key));
+    uint64_t j = 0;
+    for (uint64_t i = 0; i < map->table.number_nodes; i++) {
+        if (coordinate_table_slot_used(&map->table, i)) {
+            keys[j++] = map->table.nodes[i]._key;
+        }
+    }
+    *n_keys = j;
+    return keys;
+}
+
+void visit_keys(coordinate_map *map, key_visitor visit, void *context) {
+    for (uint64_t i = 0; i < map->table.number_nodes; i++) {
+        if (coordinate_table_slot_used(&map->table, i)) {
+            visit(map->table.nodes[i]._key, context);
+        }
+    }
+}
+
+uint64_t map_intersection_count(coordinate_map *a, coordinate_map *b) {
+    return coordinate_table_count_common(&a->table, &b->table);
+}
+
+uint64_t map_union_count(coordinate_map *a, coordinate_map *b) {
+    return map_length(a) + map_length(b) - map_intersection_count(a, b);
 }
 
-static void set_key_free(void *key, void *_global) {
-    use(_global);
-    free(key);
+uint64_t map_difference_count(coordinate_map *a, coordinate_map *b) {
+    return map_length(a) - map_intersection_count(a, b);
 }
 
-SimpleSet *init_map(map_key_n_dims *n_dims, uint64_t init_size) {
-    SimpleSet *map = malloc(sizeof(SimpleSet));
-    set_init(map, n_dims, init_size, map_key_hash, map_key_equals, map_key_copy, map_key_free);
+concurrent_coordinate_map *init_concurrent_map(map_key_n_dims *n_dims, uint64_t init_size, uint32_t n_shards) {
+    uint32_t i, bits = 0;
+    if (*n_dims > MAP_KEY_MAX_DIMS) {
+        return NULL;
+    }
+    if (n_shards == 0) {
+        n_shards = MAP_SHARDS;
+    }
+    while (((uint64_t) 1 << bits) < n_shards) {
+        bits++;
+    }
+    concurrent_coordinate_map *map = malloc(sizeof(concurrent_coordinate_map));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->n_shards = (uint32_t) 1 << bits;
+    map->shard_bits = bits;
+    map->n_dims = *n_dims;
+    map->shards = aligned_alloc(64, map->n_shards * sizeof(coordinate_map_shard));
+    if (map->shards == NULL) {
+        free(map);
+        return NULL;
+    }
+    for (i = 0; i < map->n_shards; i++) {
+        if (init_map_table(&map->shards[i].map, n_dims, init_size / map->n_shards, NULL) != SET_TRUE) {
+            while (i-- > 0) {
+                destroy_map_table(&map->shards[i].map);
+                pthread_mutex_destroy(&map->shards[i].lock);
+            }
+            free(map->shards);
+            free(map);
+            return NULL;
+        }
+        pthread_mutex_init(&map->shards[i].lock, NULL);
+    }
     return map;
 }
 
-int add_item(SimpleSet *map, map_key key, uint32_t label) {
-    int result = set_contains(map, &key);
-    if (result == SET_FALSE) {
-        SimpleSet *label_set = malloc(sizeof(SimpleSet));
-        set_init(label_set, NULL, 4, set_key_hash, set_key_equals, set_key_copy, set_key_free);
-        set_add(label_set, &label);
-        set_add_with_data(map, &key, label_set);
-        return 1;
+void destroy_concurrent_map(concurrent_coordinate_map *map) {
+    for (uint32_t i = 0; i < map->n_shards; i++) {
+        destroy_map_table(&map->shards[i].map);
+        pthread_mutex_destroy(&map->shards[i].lock);
     }
-    SimpleSet *label_set;
-    set_get_data(map, &key, (void **) &label_set);
-    if (set_add(label_set, &label) == SET_TRUE) {
-        return 1;
+    free(map->shards);
+    free(map);
+}
+
+// The shards' tables index with the low bits of map_key_hash, whose high bits
+// are the poorly mixed low bits of its product; remix before taking the top
+// bits, as ConcurrentSet does, so the shard says nothing about the slot
+static coordinate_map_shard *get_shard(concurrent_coordinate_map *map, map_key key) {
+    if (map->shard_bits == 0) {
+        return &map->shards[0];
     }
-    return 0;
+    return &map->shards[set_hash_murmur3(map_key_hash(key)) >> (64 - map->shard_bits)];
 }
 
-int get_labels(SimpleSet *map, map_key key, uint32_t ***labels, uint64_t *n_labels) {
-    SimpleSet *label_set;
-    if (set_get_data(map, &key, (void **) &label_set) == SET_TRUE) {
-        *labels = set_to_array(label_set, n_labels);
-        return 1;
+uint64_t concurrent_map_length(concurrent_coordinate_map *map) {
+    uint64_t length = 0;
+    for (uint32_t i = 0; i < map->n_shards; i++) {
+        pthread_mutex_lock(&map->shards[i].lock);
+        length += map_length(&map->shards[i].map);
+        pthread_mutex_unlock(&map->shards[i].lock);
     }
-    return 0;
+    return length;
+}
+
+int concurrent_add_item(concurrent_coordinate_map *map, map_key key, uint32_t label) {
+    coordinate_map_shard *shard = get_shard(map, key);
+    pthread_mutex_lock(&shard->lock);
+    int res = add_item(&shard->map, key, label);
+    pthread_mutex_unlock(&shard->lock);
+    return res;
 }
 
-map_key **get_keys(SimpleSet *map, uint64_t *n_keys) {
-    return (map_key **) set_to_array(map, n_keys);
+int concurrent_get_labels_into(concurrent_coordinate_map *map, map_key key, uint32_t *labels, uint64_t max_labels, uint64_t *n_labels) {
+    coordinate_map_shard *shard = get_shard(map, key);
+    pthread_mutex_lock(&shard->lock);
+    int res = get_labels_into(&shard->map, key, labels, max_labels, n_labels);
+    pthread_mutex_unlock(&shard->lock);
+    return res;
 }
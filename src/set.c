@@ -18,18 +18,32 @@
 #define MAX_FULLNESS_PERCENT 0.25       /* arbitrary */
 
 /* PRIVATE FUNCTIONS */
-static void __free(item *key);
-static void __copy(item *key, item *copy);
+static void __free(set_allocator *allocator, item *key);
+static int __copy(set_allocator *allocator, item *key, item *copy);
+static void __free_node(SimpleSet *set, simple_set_node *node);
 static int __equals(item key1, item key2);
 static uint64_t __default_hash(item key);
+static uint64_t __fnv1a_hash(item key);
+static uint64_t __home_index(SimpleSet *set, uint64_t hash);
 static int __get_index(SimpleSet *set, item key, uint64_t hash, uint64_t *index);
 static int __assign_node(SimpleSet *set, item key, uint64_t hash, uint64_t index);
+static void __insert_node(SimpleSet *set, simple_set_node *node, uint64_t index);
 static void __free_index(SimpleSet *set, uint64_t index);
+static void __remove_where(SimpleSet *set, SimpleSet *other, int in_other);
+static int __keep_common(SimpleSet *set, SimpleSet *other);
+static uint64_t __table_bytes(uint64_t num_els);
+static uint64_t* __occupied(SimpleSet *set);
+static void __set_occupied(SimpleSet *set, uint64_t index, int occupied);
+static uint64_t __next_occupied(SimpleSet *set, uint64_t from);
 static int __set_contains(SimpleSet *set, item key, uint64_t hash);
+static uint64_t __node_hash(SimpleSet *from, uint64_t index, SimpleSet *to);
 static int __set_add(SimpleSet *set, item key, uint64_t hash);
-static void __relayout_nodes(SimpleSet *set, uint64_t start, short end_on_null);
+static int __set_resize(SimpleSet *set, uint64_t num_els);
 static void __set_clear(SimpleSet *set);
 
+/* set_to_array hands out key copies the caller releases with free() */
+static set_allocator __malloc_allocator = { set_default_alloc, set_default_free, NULL };
+
 /*******************************************************************************
 ***        FUNCTIONS DEFINITIONS
 *******************************************************************************/
@@ -39,15 +53,21 @@ int set_init(SimpleSet *set) {
 }
 
 int set_init_alt(SimpleSet *set, set_hash_function hash) {
-    set->nodes = (simple_set_node**) malloc(INITIAL_NUM_ELEMENTS * sizeof(simple_set_node*));
+    return set_init_allocator(set, hash, NULL);
+}
+
+int set_init_allocator(SimpleSet *set, set_hash_function hash, const set_allocator *allocator) {
+    if (allocator == NULL) {
+        set_default_allocator(&set->allocator);
+    } else {
+        set->allocator = *allocator;
+    }
+    set->nodes = (simple_set_node**) set->allocator.alloc_function(__table_bytes(INITIAL_NUM_ELEMENTS),
+                                                                   set->allocator.context);
     if (set->nodes == NULL) {
         return SET_MALLOC_ERROR;
     }
     set->number_nodes = INITIAL_NUM_ELEMENTS;
-    uint64_t i;
-    for (i = 0; i < set->number_nodes; i++) {
-        set->nodes[i] = NULL;
-    }
     set->used_nodes = 0;
     set->hash_function = (hash == NULL) ? &__default_hash : hash;
     return SET_TRUE;
@@ -60,7 +80,7 @@ int set_clear(SimpleSet *set) {
 
 int set_destroy(SimpleSet *set) {
     __set_clear(set);
-    free(set->nodes);
+    set->allocator.free_function(set->nodes, __table_bytes(set->number_nodes), set->allocator.context);
     set->number_nodes = 0;
     set->used_nodes = 0;
     set->hash_function = NULL;
@@ -83,47 +103,96 @@ int set_remove(SimpleSet *set, item key) {
     if (pos != SET_TRUE) {
         return pos;
     }
-    // remove this node
+    // remove this node; the rest of the cluster is shifted back into the hole
     __free_index(set, index);
-    // re-layout nodes
-    __relayout_nodes(set, index, 0);
     set->used_nodes--;
     return SET_TRUE;
 }
 
+set_hash_function set_hash_by_name(const char *name) {
+    if (name != NULL && strcmp(name, "wyhash") == 0) {
+        return &__default_hash;
+    } else if (name != NULL && strcmp(name, "fnv1a") == 0) {
+        return &__fnv1a_hash;
+    }
+    return NULL;
+}
+
 uint64_t set_length(SimpleSet *set) {
     return set->used_nodes;
 }
 
 item* set_to_array(SimpleSet *set, uint64_t *size) {
-    *size = set->used_nodes;
+    *size = 0;
     item* results = malloc(set->used_nodes * sizeof(item));
     uint64_t i, j = 0;
-    for (i = 0; i < set->number_nodes; i++) {
-        if (set->nodes[i] != NULL) {
-            item *key = &(set->nodes[i]->_key);
-            __copy(key, &results[j]);
-            j++;
+    if (results == NULL && set->used_nodes != 0) {
+        return NULL;
+    }
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        item *key = &(set->nodes[i]->_key);
+        if (__copy(&__malloc_allocator, key, &results[j]) != SET_TRUE) {
+            while (j-- > 0) {
+                free(results[j].index);
+            }
+            free(results);
+            return NULL;
         }
+        j++;
     }
+    *size = set->used_nodes;
     return results;
 }
 
+void set_iter_begin(SimpleSet *set, simple_set_iterator *iter) {
+    iter->set = set;
+    iter->index = 0;
+}
+
+int set_iter_next(simple_set_iterator *iter, const item **key) {
+    SimpleSet *set = iter->set;
+    uint64_t i = __next_occupied(set, iter->index);
+    if (i == set->number_nodes) {
+        iter->index = i;
+        return SET_FALSE;
+    }
+    *key = &(set->nodes[i]->_key);
+    iter->index = i + 1;
+    return SET_TRUE;
+}
+
+void set_foreach(SimpleSet *set, set_visitor visitor, void *context) {
+    uint64_t i;
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        visitor(&(set->nodes[i]->_key), context);
+    }
+}
+
+int set_reserve(SimpleSet *set, uint64_t n_elements) {
+    uint64_t num_els = set->number_nodes;
+    while ((float)(set->used_nodes + n_elements) / num_els > MAX_FULLNESS_PERCENT) {
+        num_els *= 2;
+    }
+    if (num_els == set->number_nodes) {
+        return SET_TRUE;
+    }
+    return __set_resize(set, num_els);
+}
+
 int set_union(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
+    if (set_reserve(res, s1->used_nodes + s2->used_nodes) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
     // loop over both s1 and s2 and get keys and insert them into res
     uint64_t i;
-    for (i = 0; i < s1->number_nodes; i++) {
-        if (s1->nodes[i] != NULL) {
-            __set_add(res, s1->nodes[i]->_key, s1->nodes[i]->_hash);
-        }
+    for (i = __next_occupied(s1, 0); i < s1->number_nodes; i = __next_occupied(s1, i + 1)) {
+        __set_add(res, s1->nodes[i]->_key, __node_hash(s1, i, res));
     }
-    for (i = 0; i < s2->number_nodes; i++) {
-        if (s2->nodes[i] != NULL) {
-            __set_add(res, s2->nodes[i]->_key, s2->nodes[i]->_hash);
-        }
+    for (i = __next_occupied(s2, 0); i < s2->number_nodes; i = __next_occupied(s2, i + 1)) {
+        __set_add(res, s2->nodes[i]->_key, __node_hash(s2, i, res));
     }
     return SET_TRUE;
 }
@@ -132,13 +201,16 @@ int set_intersection(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
-    // loop over both one of s1 and s2: get keys, check the other, and insert them into res if it is
+    // loop over the smaller of s1 and s2: get keys, check the other, and insert them into res if it is
+    SimpleSet *small = (s2->used_nodes < s1->used_nodes) ? s2 : s1;
+    SimpleSet *large = (small == s1) ? s2 : s1;
+    if (set_reserve(res, small->used_nodes) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
     uint64_t i;
-    for (i = 0; i < s1->number_nodes; i++) {
-        if (s1->nodes[i] != NULL) {
-            if (__set_contains(s2, s1->nodes[i]->_key, s1->nodes[i]->_hash) == SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, s1->nodes[i]->_hash);
-            }
+    for (i = __next_occupied(small, 0); i < small->number_nodes; i = __next_occupied(small, i + 1)) {
+        if (__set_contains(large, small->nodes[i]->_key, __node_hash(small, i, large)) == SET_TRUE) {
+            __set_add(res, small->nodes[i]->_key, __node_hash(small, i, res));
         }
     }
     return SET_TRUE;
@@ -149,13 +221,14 @@ int set_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
+    if (set_reserve(res, s1->used_nodes) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
     // loop over s1 and keep only things not in s2
     uint64_t i;
-    for (i = 0; i < s1->number_nodes; i++) {
-        if (s1->nodes[i] != NULL) {
-            if (__set_contains(s2, s1->nodes[i]->_key, s1->nodes[i]->_hash) != SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, s1->nodes[i]->_hash);
-            }
+    for (i = __next_occupied(s1, 0); i < s1->number_nodes; i = __next_occupied(s1, i + 1)) {
+        if (__set_contains(s2, s1->nodes[i]->_key, __node_hash(s1, i, s2)) != SET_TRUE) {
+            __set_add(res, s1->nodes[i]->_key, __node_hash(s1, i, res));
         }
     }
     return SET_TRUE;
@@ -165,33 +238,116 @@ int set_symmetric_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
+    if (set_reserve(res, s1->used_nodes + s2->used_nodes) != SET_TRUE) {
+        return SET_MALLOC_ERROR;
+    }
     uint64_t i;
     // loop over set 1 and add elements that are unique to set 1
-    for (i = 0; i < s1->number_nodes; i++) {
-        if (s1->nodes[i] != NULL) {
-            if (__set_contains(s2, s1->nodes[i]->_key, s1->nodes[i]->_hash) != SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, s1->nodes[i]->_hash);
-            }
+    for (i = __next_occupied(s1, 0); i < s1->number_nodes; i = __next_occupied(s1, i + 1)) {
+        if (__set_contains(s2, s1->nodes[i]->_key, __node_hash(s1, i, s2)) != SET_TRUE) {
+            __set_add(res, s1->nodes[i]->_key, __node_hash(s1, i, res));
         }
     }
     // loop over set 2 and add elements that are unique to set 2
-    for (i = 0; i < s2->number_nodes; i++) {
-        if (s2->nodes[i] != NULL) {
-            if (__set_contains(s1, s2->nodes[i]->_key, s2->nodes[i]->_hash) != SET_TRUE) {
-                __set_add(res, s2->nodes[i]->_key, s2->nodes[i]->_hash);
-            }
+    for (i = __next_occupied(s2, 0); i < s2->number_nodes; i = __next_occupied(s2, i + 1)) {
+        if (__set_contains(s1, s2->nodes[i]->_key, __node_hash(s2, i, s1)) != SET_TRUE) {
+            __set_add(res, s2->nodes[i]->_key, __node_hash(s2, i, res));
+        }
+    }
+    return SET_TRUE;
+}
+
+uint64_t set_intersection_count(SimpleSet *s1, SimpleSet *s2) {
+    SimpleSet *small = (s2->used_nodes < s1->used_nodes) ? s2 : s1;
+    SimpleSet *large = (small == s1) ? s2 : s1;
+    uint64_t i, count = 0;
+    for (i = __next_occupied(small, 0); i < small->number_nodes; i = __next_occupied(small, i + 1)) {
+        if (__set_contains(large, small->nodes[i]->_key, __node_hash(small, i, large)) == SET_TRUE) {
+            count++;
+        }
+    }
+    return count;
+}
+
+uint64_t set_union_count(SimpleSet *s1, SimpleSet *s2) {
+    return s1->used_nodes + s2->used_nodes - set_intersection_count(s1, s2);
+}
+
+uint64_t set_difference_count(SimpleSet *s1, SimpleSet *s2) {
+    return s1->used_nodes - set_intersection_count(s1, s2);
+}
+
+int set_union_into(SimpleSet *dest, SimpleSet *src) {
+    if (dest == src) {
+        return SET_TRUE;
+    }
+    uint64_t i;
+    for (i = __next_occupied(src, 0); i < src->number_nodes; i = __next_occupied(src, i + 1)) {
+        if (__set_add(dest, src->nodes[i]->_key, __node_hash(src, i, dest)) == SET_MALLOC_ERROR) {
+            return SET_MALLOC_ERROR;
+        }
+    }
+    return SET_TRUE;
+}
+
+int set_intersect_update(SimpleSet *dest, SimpleSet *other) {
+    if (dest == other) {
+        return SET_TRUE;
+    }
+    // walk the smaller set; if other is smaller and there is no memory to do
+    // that, sweeping dest gets the same result
+    if (other->used_nodes >= dest->used_nodes || __keep_common(dest, other) != SET_TRUE) {
+        __remove_where(dest, other, SET_FALSE);
+    }
+    return SET_TRUE;
+}
+
+int set_difference_update(SimpleSet *dest, SimpleSet *other) {
+    if (dest == other) {
+        return set_clear(dest);
+    }
+    if (other->used_nodes >= dest->used_nodes) {
+        __remove_where(dest, other, SET_TRUE);
+        return SET_TRUE;
+    }
+    // remove each of other's keys from dest
+    uint64_t i, index;
+    for (i = __next_occupied(other, 0); i < other->number_nodes; i = __next_occupied(other, i + 1)) {
+        if (__get_index(dest, other->nodes[i]->_key, __node_hash(other, i, dest), &index) == SET_TRUE) {
+            __free_index(dest, index);
+            dest->used_nodes--;
+        }
+    }
+    return SET_TRUE;
+}
+
+int set_symmetric_difference_update(SimpleSet *dest, SimpleSet *other) {
+    if (dest == other) {
+        return set_clear(dest);
+    }
+    // keys of other that dest has go, the rest come in
+    uint64_t i, index;
+    for (i = __next_occupied(other, 0); i < other->number_nodes; i = __next_occupied(other, i + 1)) {
+        simple_set_node *node = other->nodes[i];
+        uint64_t hash = __node_hash(other, i, dest);
+        if (__get_index(dest, node->_key, hash, &index) == SET_TRUE) {
+            __free_index(dest, index);
+            dest->used_nodes--;
+        } else if (__set_add(dest, node->_key, hash) == SET_MALLOC_ERROR) {
+            return SET_MALLOC_ERROR;
         }
     }
     return SET_TRUE;
 }
 
 int set_is_subset(SimpleSet *test, SimpleSet *against) {
+    if (test->used_nodes > against->used_nodes) {
+        return SET_FALSE;
+    }
     uint64_t i;
-    for (i = 0; i < test->number_nodes; i++) {
-        if (test->nodes[i] != NULL) {
-            if (__set_contains(against, test->nodes[i]->_key, test->nodes[i]->_hash) == SET_FALSE) {
-                return SET_FALSE;
-            }
+    for (i = __next_occupied(test, 0); i < test->number_nodes; i = __next_occupied(test, i + 1)) {
+        if (__set_contains(against, test->nodes[i]->_key, __node_hash(test, i, against)) == SET_FALSE) {
+            return SET_FALSE;
         }
     }
     return SET_TRUE;
@@ -219,11 +375,9 @@ int set_cmp(SimpleSet *left, SimpleSet *right) {
         return 1;
     }
     uint64_t i;
-    for (i = 0; i < left->number_nodes; i++) {
-        if (left->nodes[i] != NULL) {
-            if (set_contains(right, left->nodes[i]->_key) != SET_TRUE) {
-                return 2;
-            }
+    for (i = __next_occupied(left, 0); i < left->number_nodes; i = __next_occupied(left, i + 1)) {
+        if (set_contains(right, left->nodes[i]->_key) != SET_TRUE) {
+            return 2;
         }
     }
 
@@ -234,16 +388,25 @@ int set_cmp(SimpleSet *left, SimpleSet *right) {
 /*******************************************************************************
 ***        PRIVATE FUNCTIONS
 *******************************************************************************/
-static void __copy(item *key, item *copy) {
+static int __copy(set_allocator *allocator, item *key, item *copy) {
     int n_bytes = key->n_dims * sizeof(uint16_t);
-    copy->index = malloc(n_bytes);
+    copy->index = allocator->alloc_function(n_bytes, allocator->context);
+    if (copy->index == NULL && n_bytes != 0) {
+        return SET_MALLOC_ERROR;
+    }
     copy->n_dims = key->n_dims;
     copy->label = key->label;
     memcpy(copy->index, key->index, n_bytes);
+    return SET_TRUE;
 }
 
-static void __free(item *key) {
-    free(key->index);
+static void __free(set_allocator *allocator, item *key) {
+    allocator->free_function(key->index, key->n_dims * sizeof(uint16_t), allocator->context);
+}
+
+static void __free_node(SimpleSet *set, simple_set_node *node) {
+    __free(&set->allocator, &(node->_key));
+    set->allocator.free_function(node, sizeof(simple_set_node), set->allocator.context);
 }
 
 static int __equals(item key_1, item key_2) {
@@ -259,13 +422,23 @@ static int __equals(item key_1, item key_2) {
 }
 
 static uint64_t __default_hash(item key) {
-    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
-    uint64_t h = 14695981039346656073ULL; // FNV_OFFSET 64 bit
-    for (int i = 0; i < key.n_dims; i++){
-        h = h ^ key.index[i];
-        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
-    }
-    return h;
+    return set_hash_u16(key.index, key.n_dims);
+}
+
+static uint64_t __fnv1a_hash(item key) {
+    return set_hash_fnv1a_u16(key.index, key.n_dims);
+}
+
+/*  The table size is always a power of two (INITIAL_NUM_ELEMENTS doubled),
+    so the home slot is a mask of the hash after a finalizer (from
+    MurmurHash3) that spreads the high bits into the low ones */
+static uint64_t __home_index(SimpleSet *set, uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash & (set->number_nodes - 1);
 }
 
 static int __set_contains(SimpleSet *set, item key, uint64_t hash) {
@@ -273,31 +446,34 @@ static int __set_contains(SimpleSet *set, item key, uint64_t hash) {
     return __get_index(set, key, hash, &index);
 }
 
+/*  The hash of a node in one set, as needed to probe another set. The hash
+    cached in the node is reused only when both sets hash keys the same way. */
+static uint64_t __node_hash(SimpleSet *from, uint64_t index, SimpleSet *to) {
+    if (from->hash_function == to->hash_function) {
+        return from->nodes[index]->_hash;
+    }
+    return to->hash_function(from->nodes[index]->_key);
+}
+
 static int __set_add(SimpleSet *set, item key, uint64_t hash) {
     uint64_t index;
-    if (__set_contains(set, key, hash) == SET_TRUE) {
+    int res = __get_index(set, key, hash, &index);
+    if (res == SET_TRUE) {
         return SET_ALREADY_PRESENT;
     }
     // Expand nodes if we are close to our desired fullness
     if ((float)set->used_nodes / set->number_nodes > MAX_FULLNESS_PERCENT) {
-        uint64_t num_els = set->number_nodes * 2; // we want to double each time
-        simple_set_node** tmp = realloc(set->nodes, num_els * sizeof(simple_set_node*));
-        if (tmp == NULL || set->nodes == NULL) { // malloc failure
+        // we want to double each time
+        if (__set_resize(set, set->number_nodes * 2) != SET_TRUE) {
             return SET_MALLOC_ERROR;
         }
-        set->nodes = tmp;
-        uint64_t i, orig_num_els = set->number_nodes;
-        for (i = orig_num_els; i < num_els; i++) {
-            set->nodes[i] = NULL;
-        }
-        set->number_nodes = num_els;
-        // re-layout all nodes
-        __relayout_nodes(set, 0, 1);
+        res = __get_index(set, key, hash, &index);
     }
     // add element in
-    int res = __get_index(set, key, hash, &index);
-    if (res == SET_FALSE) { // this is the first open slot
-        __assign_node(set, key, hash, index);
+    if (res == SET_FALSE) { // this is where the element belongs
+        if (__assign_node(set, key, hash, index) != SET_TRUE) {
+            return SET_MALLOC_ERROR;
+        }
         set->used_nodes++;
         return SET_TRUE;
     } else {
@@ -305,14 +481,15 @@ static int __set_add(SimpleSet *set, item key, uint64_t hash) {
     }
 }
 
+/*  Robin Hood probing: a lookup stops at the first node that is closer to
+    its home slot than the key being searched for would be */
 static int __get_index(SimpleSet *set, item key, uint64_t hash, uint64_t *index) {
-    uint64_t i, idx;
-    idx = hash % set->number_nodes;
-    i = idx;
+    uint64_t i, dist = 0;
+    i = __home_index(set, hash);
     while (1) {
-        if (set->nodes[i] == NULL) {
+        if (set->nodes[i] == NULL || set->nodes[i]->_dist < dist) {
             *index = i;
-            return SET_FALSE; // not here OR first open slot
+            return SET_FALSE; // not here; this is where it would go
         } else if (hash == set->nodes[i]->_hash && __equals(set->nodes[i]->_key, key)) {
             *index = i;
             return SET_TRUE;
@@ -321,8 +498,9 @@ static int __get_index(SimpleSet *set, item key, uint64_t hash, uint64_t *index)
             if (i == set->number_nodes) {
                 i = 0;
             }
+            dist++;
 
-            if (i == idx) { // this means we went all the way around and the set is full
+            if (dist == set->number_nodes) { // this means we went all the way around and the set is full
                 return SET_CIRCULAR_ERROR;
             }
         }
@@ -330,39 +508,177 @@ static int __get_index(SimpleSet *set, item key, uint64_t hash, uint64_t *index)
 }
 
 static int __assign_node(SimpleSet *set, item key, uint64_t hash, uint64_t index) {
-    set->nodes[index] = malloc(sizeof(simple_set_node));
-    __copy(&key, &(set->nodes[index]->_key));
-    set->nodes[index]->_hash = hash;
+    simple_set_node *node = set->allocator.alloc_function(sizeof(simple_set_node), set->allocator.context);
+    if (node == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    if (__copy(&set->allocator, &key, &(node->_key)) != SET_TRUE) {
+        set->allocator.free_function(node, sizeof(simple_set_node), set->allocator.context);
+        return SET_MALLOC_ERROR;
+    }
+    node->_hash = hash;
+    uint64_t home = __home_index(set, hash);
+    node->_dist = (index >= home) ? index - home : index + set->number_nodes - home;
+    __insert_node(set, node, index);
     return SET_TRUE;
 }
 
+/*  Place node at index, displacing any node that is closer to its home */
+static void __insert_node(SimpleSet *set, simple_set_node *node, uint64_t index) {
+    simple_set_node *tmp;
+    while (set->nodes[index] != NULL) {
+        if (set->nodes[index]->_dist < node->_dist) {
+            tmp = set->nodes[index];
+            set->nodes[index] = node;
+            node = tmp;
+        }
+        node->_dist++;
+        index++;
+        if (index == set->number_nodes) {
+            index = 0;
+        }
+    }
+    set->nodes[index] = node;
+    __set_occupied(set, index, 1);
+}
+
+/*  Free the node at index and shift the displaced nodes that follow back
+    one slot each */
 static void __free_index(SimpleSet *set, uint64_t index) {
-    __free(&(set->nodes[index]->_key));
-    free(set->nodes[index]);
+    __free_node(set, set->nodes[index]);
+    uint64_t next = index + 1;
+    if (next == set->number_nodes) {
+        next = 0;
+    }
+    while (set->nodes[next] != NULL && set->nodes[next]->_dist != 0) {
+        set->nodes[index] = set->nodes[next];
+        set->nodes[index]->_dist--;
+        index = next;
+        next++;
+        if (next == set->number_nodes) {
+            next = 0;
+        }
+    }
     set->nodes[index] = NULL;
+    __set_occupied(set, index, 0);
 }
 
-static void __relayout_nodes(SimpleSet *set, uint64_t start, short end_on_null) {
-    uint64_t index = 0, i;
-    for (i = start; i < set->number_nodes; i++) {
-        if(set->nodes[i] != NULL) {
-            __get_index(set, set->nodes[i]->_key, set->nodes[i]->_hash, &index);
-            if (i != index) { // we are moving this node
-                __assign_node(set, set->nodes[i]->_key, set->nodes[i]->_hash, index);
-                __free_index(set, i);
-            }
-        } else if (end_on_null == 0 && i != start) {
-            break;
+/*  The node pointers are followed by the occupancy bitmap, one bit per slot,
+    so that walks over the set can skip empty slots 64 at a time */
+static uint64_t __table_bytes(uint64_t num_els) {
+    return num_els * sizeof(simple_set_node*) + (num_els + 63) / 64 * sizeof(uint64_t);
+}
+
+static uint64_t* __occupied(SimpleSet *set) {
+    return (uint64_t *) (set->nodes + set->number_nodes);
+}
+
+static void __set_occupied(SimpleSet *set, uint64_t index, int occupied) {
+    uint64_t *word = &__occupied(set)[index / 64];
+    if (occupied) {
+        *word |= 1ULL << (index % 64);
+    } else {
+        *word &= ~(1ULL << (index % 64));
+    }
+}
+
+/* The first occupied slot at or after from, or number_nodes if there is none */
+static uint64_t __next_occupied(SimpleSet *set, uint64_t from) {
+    if (from >= set->number_nodes) {
+        return set->number_nodes;
+    }
+    uint64_t *occupied = __occupied(set);
+    uint64_t w = from / 64, n_words = (set->number_nodes + 63) / 64;
+    uint64_t bits = occupied[w] & (~0ULL << (from % 64));
+    while (bits == 0) {
+        if (++w == n_words) {
+            return set->number_nodes;
         }
+        bits = occupied[w];
     }
+    return w * 64 + __builtin_ctzll(bits);
 }
 
-static void __set_clear(SimpleSet *set) {
-    uint64_t i;
-    for(i = 0; i < set->number_nodes; i++) {
-        if (set->nodes[i] != NULL) {
+/*  Remove every key of set that is (in_other == SET_TRUE) or is not
+    (SET_FALSE) in other. Removing shifts the rest of the cluster back one
+    slot, so the slot just emptied is looked at again. */
+static void __remove_where(SimpleSet *set, SimpleSet *other, int in_other) {
+    uint64_t i = __next_occupied(set, 0);
+    while (i < set->number_nodes) {
+        int found = __set_contains(other, set->nodes[i]->_key, __node_hash(set, i, other)) == SET_TRUE;
+        if (found == (in_other == SET_TRUE)) {
             __free_index(set, i);
+            set->used_nodes--;
+            i = __next_occupied(set, i);
+        } else {
+            i = __next_occupied(set, i + 1);
+        }
+    }
+}
+
+/*  Intersect set with a smaller other by looking other's keys up in set:
+    the nodes found are marked, everything else is freed, and the marked
+    nodes are put back. SET_MALLOC_ERROR if there was no room to list them,
+    in which case set is untouched. */
+static int __keep_common(SimpleSet *set, SimpleSet *other) {
+    uint64_t i, index, n_keep = 0;
+    simple_set_node **keep = malloc((other->used_nodes + 1) * sizeof(simple_set_node*));
+    if (keep == NULL) {
+        return SET_MALLOC_ERROR;
+    }
+    for (i = __next_occupied(other, 0); i < other->number_nodes; i = __next_occupied(other, i + 1)) {
+        if (__get_index(set, other->nodes[i]->_key, __node_hash(other, i, set), &index) == SET_TRUE) {
+            keep[n_keep++] = set->nodes[index];
         }
     }
+    // lookups are done, so _dist is free to mark the nodes to keep
+    for (i = 0; i < n_keep; i++) {
+        keep[i]->_dist = UINT32_MAX;
+    }
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        if (set->nodes[i]->_dist != UINT32_MAX) {
+            __free_node(set, set->nodes[i]);
+        }
+        set->nodes[i] = NULL;
+        __set_occupied(set, i, 0);
+    }
+    for (i = 0; i < n_keep; i++) {
+        keep[i]->_dist = 0;
+        __insert_node(set, keep[i], __home_index(set, keep[i]->_hash));
+    }
+    set->used_nodes = n_keep;
+    free(keep);
+    return SET_TRUE;
+}
+
+static int __set_resize(SimpleSet *set, uint64_t num_els) {
+    simple_set_node **old_nodes = set->nodes;
+    uint64_t i, old_num_els = set->number_nodes;
+    set->nodes = (simple_set_node**) set->allocator.alloc_function(__table_bytes(num_els),
+                                                                   set->allocator.context);
+    if (set->nodes == NULL) { // malloc failure
+        set->nodes = old_nodes;
+        return SET_MALLOC_ERROR;
+    }
+    set->number_nodes = num_els;
+    // re-insert all nodes using their cached hashes
+    for (i = 0; i < old_num_els; i++) {
+        if (old_nodes[i] != NULL) {
+            old_nodes[i]->_dist = 0;
+            __insert_node(set, old_nodes[i], __home_index(set, old_nodes[i]->_hash));
+        }
+    }
+    set->allocator.free_function(old_nodes, __table_bytes(old_num_els), set->allocator.context);
+    return SET_TRUE;
+}
+
+static void __set_clear(SimpleSet *set) {
+    uint64_t i;
+    // only the occupied slots need to be reset
+    for (i = __next_occupied(set, 0); i < set->number_nodes; i = __next_occupied(set, i + 1)) {
+        __free_node(set, set->nodes[i]);
+        set->nodes[i] = NULL;
+        __set_occupied(set, i, 0);
+    }
     set->used_nodes = 0;
 }
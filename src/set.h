@@ -16,6 +16,8 @@
 #define BARRUST_SIMPLE_SET_H__
 
 #include <inttypes.h>       /* uint64_t */
+#include "set_allocator.h"
+#include "set_hash.h"
 
 typedef struct {
     uint16_t n_dims;
@@ -24,10 +26,13 @@ typedef struct {
 } item;
 
 typedef uint64_t (*set_hash_function) (item key);
+typedef void (*set_visitor) (const item *key, void *context);
 
+/* _dist is how far the node sits from its home slot (Robin Hood probing) */
 typedef struct  {
     item _key;
     uint64_t _hash;
+    uint32_t _dist;
 } SimpleSetNode, simple_set_node;
 
 typedef struct  {
@@ -35,8 +40,15 @@ typedef struct  {
     uint64_t number_nodes;
     uint64_t used_nodes;
     set_hash_function hash_function;
+    set_allocator allocator;
 } SimpleSet, simple_set;
 
+/*  Cursor over the keys of a set, see set_iter_begin */
+typedef struct  {
+    SimpleSet *set;
+    uint64_t index;
+} SimpleSetIterator, simple_set_iterator;
+
 
 /* Initialize the set with default values */
 int set_init(SimpleSet *set);
@@ -44,6 +56,15 @@ int set_init(SimpleSet *set);
 /* Initialize the set with a different hash function */
 int set_init_alt(SimpleSet *set, set_hash_function hash);
 
+/*  The built in hash called name, "wyhash" (the default) or "fnv1a", for
+    set_init_alt / set_init_allocator; NULL if there is no such hash */
+set_hash_function set_hash_by_name(const char *name);
+
+/*  Initialize the set with a hash function (NULL for the default) and an
+    allocator for the node table, the nodes and the key copies (see
+    set_allocator.h); a NULL allocator uses calloc / free */
+int set_init_allocator(SimpleSet *set, set_hash_function hash, const set_allocator *allocator);
+
 /* Utility function to clear out the set */
 int set_clear(SimpleSet *set);
 
@@ -63,9 +84,18 @@ int set_remove(SimpleSet *set, item key);
     found, or SET_CIRCULAR_ERROR if set is full and not found */
 int set_contains(SimpleSet *set, item key);
 
+/*  Make room for n_elements more elements so that adding them will not grow
+    the set; Returns SET_TRUE or SET_MALLOC_ERROR */
+int set_reserve(SimpleSet *set, uint64_t n_elements);
+
 /* Return the number of elements in the set */
 uint64_t set_length(SimpleSet *set);
 
+/*  NOTE: The set algebra functions that follow reserve room in res for
+          the largest possible result up front (the smaller set for an
+          intersection, both sets for a union) and return SET_MALLOC_ERROR
+          if that fails; an intersection walks the smaller set */
+
 /*  Set res to the union of s1 and s2
     res = s1 ∪ s2
 
@@ -97,6 +127,34 @@ int set_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
     A △ B or A * B */
 int set_symmetric_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
 
+/*  The sizes of the results above without building them: nothing is
+    copied or allocated, the smaller set's keys are just looked up in the
+    other
+    |s1 ∩ s2| */
+uint64_t set_intersection_count(SimpleSet *s1, SimpleSet *s2);
+
+/* |s1 ∪ s2| */
+uint64_t set_union_count(SimpleSet *s1, SimpleSet *s2);
+
+/* |s1 ∖ s2| */
+uint64_t set_difference_count(SimpleSet *s1, SimpleSet *s2);
+
+/*  In place versions of the above: dest is updated and keeps its storage,
+    so only the keys that differ are copied in or freed. The intersection
+    and difference walk whichever set is smaller. Returns SET_TRUE, or
+    SET_MALLOC_ERROR if a key could not be added
+    dest = dest ∪ src */
+int set_union_into(SimpleSet *dest, SimpleSet *src);
+
+/* dest = dest ∩ other */
+int set_intersect_update(SimpleSet *dest, SimpleSet *other);
+
+/* dest = dest ∖ other */
+int set_difference_update(SimpleSet *dest, SimpleSet *other);
+
+/* dest = dest △ other */
+int set_symmetric_difference_update(SimpleSet *dest, SimpleSet *other);
+
 /*  Return SET_TRUE if test is fully contained in s2; returns SET_FALSE
     otherwise
     test ⊆ against
@@ -134,10 +192,21 @@ int set_is_subset_strict(SimpleSet *test, SimpleSet *against);
     The superset relationship is denoted as A ⊃ B */
 int set_is_superset_strict(SimpleSet *test, SimpleSet *against);
 
-/*  Return an array of the elements in the set
+/*  Return an array of the elements in the set, or NULL (with *size 0) on
+    malloc failure
     NOTE: Up to the caller to free the memory */
 item* set_to_array(SimpleSet *set, uint64_t *size);
 
+/*  Walk the set without copying anything: after set_iter_begin each call to
+    set_iter_next points *key at the next stored key and returns SET_TRUE,
+    or returns SET_FALSE once every key has been visited. The keys are
+    borrowed from the set, which must not be modified while it is walked */
+void set_iter_begin(SimpleSet *set, simple_set_iterator *iter);
+int set_iter_next(simple_set_iterator *iter, const item **key);
+
+/*  Call visitor(key, context) for every key in the set */
+void set_foreach(SimpleSet *set, set_visitor visitor, void *context);
+
 /*  Returns based on number elements:
     -1 if left is less than right
     1 if right is less than left
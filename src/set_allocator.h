@@ -0,0 +1,115 @@
+/*******************************************************************************
+***
+***     Allocator hooks shared by set.c and hash_map.c
+***
+***     Purpose: Let the caller decide where node tables, nodes and key copies
+***              live; includes a transparent huge page backed allocator for
+***              very large tables
+***
+***     License: MIT 2016
+***
+***     Usage:
+***         set_allocator allocator;
+***         set_huge_page_allocator(&allocator);
+***         set_init_allocator(&set, ..., &allocator);
+***
+*******************************************************************************/
+
+#ifndef SET_ALLOCATOR_H__
+#define SET_ALLOCATOR_H__
+
+#include <inttypes.h>       /* uint64_t */
+#include <stdlib.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  alloc_function returns size bytes of zeroed memory (or NULL);
+    free_function receives the same size the block was allocated with, so
+    allocators do not have to track it. context is passed to both. */
+typedef void* (*set_alloc_function) (uint64_t size, void *context);
+typedef void (*set_free_function) (void *ptr, uint64_t size, void *context);
+
+typedef struct  {
+    set_alloc_function alloc_function;
+    set_free_function free_function;
+    void *context;
+} SetAllocator, set_allocator;
+
+#define SET_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static inline void* set_default_alloc(uint64_t size, void *context) {
+    (void) context;
+    return calloc(1, size);
+}
+
+static inline void set_default_free(void *ptr, uint64_t size, void *context) {
+    (void) size;
+    (void) context;
+    free(ptr);
+}
+
+/*  Blocks of at least SET_HUGE_PAGE_SIZE are mapped 2MB aligned and advised
+    as transparent huge pages so that a multi-GB table needs a few thousand
+    TLB entries instead of a million; anything smaller, or any platform
+    without madvise(MADV_HUGEPAGE), falls back to calloc */
+static inline void* set_huge_page_alloc(uint64_t size, void *context) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (size >= SET_HUGE_PAGE_SIZE) {
+        uint64_t length = (size + SET_HUGE_PAGE_SIZE - 1) & ~(uint64_t)(SET_HUGE_PAGE_SIZE - 1);
+        // over-map by one huge page and trim both ends to get an aligned block
+        char *map = (char *) mmap(NULL, length + SET_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        char *start = (char *) (((uintptr_t) map + SET_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(SET_HUGE_PAGE_SIZE - 1));
+        if (start != map) {
+            munmap(map, start - map);
+        }
+        if (start + length != map + length + SET_HUGE_PAGE_SIZE) {
+            munmap(start + length, (map + length + SET_HUGE_PAGE_SIZE) - (start + length));
+        }
+        madvise(start, length, MADV_HUGEPAGE);  // only advice; the mapping works either way
+        return start;
+    }
+#endif
+    return set_default_alloc(size, context);
+}
+
+static inline void set_huge_page_free(void *ptr, uint64_t size, void *context) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (size >= SET_HUGE_PAGE_SIZE) {
+        if (ptr != NULL) {
+            munmap(ptr, (size + SET_HUGE_PAGE_SIZE - 1) & ~(uint64_t)(SET_HUGE_PAGE_SIZE - 1));
+        }
+        return;
+    }
+#endif
+    set_default_free(ptr, size, context);
+}
+
+/* Fill in the calloc / free allocator used when none is given */
+static inline void set_default_allocator(set_allocator *allocator) {
+    allocator->alloc_function = set_default_alloc;
+    allocator->free_function = set_default_free;
+    allocator->context = NULL;
+}
+
+/* Fill in the huge page backed allocator */
+static inline void set_huge_page_allocator(set_allocator *allocator) {
+    allocator->alloc_function = set_huge_page_alloc;
+    allocator->free_function = set_huge_page_free;
+    allocator->context = NULL;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif /* END SET_ALLOCATOR_H__ */
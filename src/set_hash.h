@@ -0,0 +1,180 @@
+/*******************************************************************************
+***
+***     Hash function suite
+***
+***     Purpose: Word-at-a-time hashes for the key types used with set,
+***              hash_map and the coordinate maps, selectable by name
+***
+***     License: MIT 2016
+***
+***     Usage:
+***         uint64_t h = set_hash_int(label);
+***         uint64_t h = set_hash_u16(coords, n_dims);
+***         set_int_hash_function f = set_int_hash_by_name("coordinates");
+***
+***     Names:
+***         "fnv1a"               FNV-1a, the old default: the integer hash
+***                               takes a byte per step, the uint16 array
+***                               hash a uint16 per step
+***         "murmur3"             the 64 bit finalizer from MurmurHash3
+***         "multiply_xorshift"   one multiply between two xorshifts
+***         "coordinates"         Fibonacci hashing of a packed map_key with
+***                               the halves of the product swapped, so the
+***                               low bits used to pick a slot see every
+***                               coordinate
+***         "wyhash"              (arrays only) 8 bytes at a time in the
+***                               style of wyhash
+***
+*******************************************************************************/
+
+#ifndef SET_HASH_H__
+#define SET_HASH_H__
+
+#include <inttypes.h>       /* uint64_t */
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint64_t (*set_int_hash_function) (uint64_t key);
+typedef uint64_t (*set_u16_hash_function) (const uint16_t *data, uint64_t n);
+
+/* secrets from wyhash */
+#define SET_HASH_SEED_0 0xa0761d6478bd642fULL
+#define SET_HASH_SEED_1 0xe7037ed1a0b428dbULL
+#define SET_HASH_SEED_2 0x8ebc6af09c88c6e3ULL
+
+/*  Multiply a and b to 128 bits and xor the halves together */
+static inline uint64_t set_hash_mum(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t) a, lb = (uint32_t) b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+static inline uint64_t set_hash_fnv1a_int(uint64_t key) {
+    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
+    uint64_t h = 14695981039346656073ULL; // FNV_OFFSET 64 bit
+    for (int i = 0; i < 8; i++) {
+        h = h ^ ((key >> (8 * i)) & 0xFF);
+        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
+    }
+    return h;
+}
+
+static inline uint64_t set_hash_murmur3(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/*  The first xorshift lets the high half of key reach the multiply, the
+    second brings the well mixed high bits of the product down to the low
+    bits a power of two table indexes with */
+static inline uint64_t set_hash_int(uint64_t key) {
+    key ^= key >> 32;
+    key *= 0xd6e8feb86659fd93ULL;
+    key ^= key >> 32;
+    return key;
+}
+
+/*  Multiplying by 2^64 / phi spreads a grid of small coordinates evenly
+    (far fewer long probes than a random hash on dense grids); folding the
+    upper two coordinates down first keeps keys that differ only there apart */
+static inline uint64_t set_hash_coordinates(uint64_t key) {
+    key = (key ^ (key >> 32)) * 0x9e3779b97f4a7c15ULL;
+    return (key >> 32) | (key << 32);
+}
+
+static inline uint64_t __set_hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*  Hash n_bytes of data 16 bytes per multiply; the tail is read as (up to)
+    two overlapping words so there is no byte loop */
+static inline uint64_t set_hash_bytes(const void *data, uint64_t n_bytes) {
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t seed = SET_HASH_SEED_0 ^ n_bytes, a, b, i = n_bytes;
+    while (i > 16) {
+        seed = set_hash_mum(__set_hash_read64(p) ^ SET_HASH_SEED_1, __set_hash_read64(p + 8) ^ seed);
+        p += 16;
+        i -= 16;
+    }
+    if (i >= 8) {
+        a = __set_hash_read64(p);
+        b = __set_hash_read64(p + i - 8);
+    } else if (i >= 4) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + i - 4, 4);
+        a = lo;
+        b = hi;
+    } else if (i > 0) {
+        a = ((uint64_t) p[0] << 16) | ((uint64_t) p[i >> 1] << 8) | p[i - 1];
+        b = 0;
+    } else {
+        a = b = 0;
+    }
+    return set_hash_mum(SET_HASH_SEED_1 ^ n_bytes, set_hash_mum(a ^ SET_HASH_SEED_1, b ^ seed) ^ SET_HASH_SEED_2);
+}
+
+static inline uint64_t set_hash_u16(const uint16_t *data, uint64_t n) {
+    return set_hash_bytes(data, n * sizeof(uint16_t));
+}
+
+static inline uint64_t set_hash_fnv1a_u16(const uint16_t *data, uint64_t n) {
+    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
+    uint64_t h = 14695981039346656073ULL; // FNV_OFFSET 64 bit
+    for (uint64_t i = 0; i < n; i++) {
+        h = h ^ data[i];
+        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
+    }
+    return h;
+}
+
+/*  The integer hash called name (see the list above), or NULL */
+static inline set_int_hash_function set_int_hash_by_name(const char *name) {
+    if (name == NULL) {
+        return NULL;
+    } else if (strcmp(name, "fnv1a") == 0) {
+        return set_hash_fnv1a_int;
+    } else if (strcmp(name, "murmur3") == 0) {
+        return set_hash_murmur3;
+    } else if (strcmp(name, "multiply_xorshift") == 0) {
+        return set_hash_int;
+    } else if (strcmp(name, "coordinates") == 0) {
+        return set_hash_coordinates;
+    }
+    return NULL;
+}
+
+/*  The uint16 array hash called name ("fnv1a" or "wyhash"), or NULL */
+static inline set_u16_hash_function set_u16_hash_by_name(const char *name) {
+    if (name == NULL) {
+        return NULL;
+    } else if (strcmp(name, "fnv1a") == 0) {
+        return set_hash_fnv1a_u16;
+    } else if (strcmp(name, "wyhash") == 0) {
+        return set_hash_u16;
+    }
+    return NULL;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif /* END SET_HASH_H__ */
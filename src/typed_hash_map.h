@@ -0,0 +1,338 @@
+/*******************************************************************************
+***
+***     Typed hash map generator
+***
+***     Purpose: Instantiate a hash map for a concrete key and value type so
+***              that hashing, equality and copies are inlined instead of
+***              going through function pointers
+***
+***     License: MIT 2016
+***
+***     Usage:
+***         // in a header
+***         TYPED_HASH_MAP_DECLARE(point_map, point, uint32_t)
+***         // in exactly one source file
+***         TYPED_HASH_MAP_IMPL(point_map, point, uint32_t, point_hash, point_equals)
+***
+***     where point_hash(point key) returns a uint64_t and
+***     point_equals(point a, point b) returns non-zero if the keys match. Both
+***     may be functions or macros. Keys and values are stored by value in the
+***     node table and copied with plain assignment. The low bits of the hash
+***     pick the home slot as is, so point_hash must mix well (see set_hash.h,
+***     or wrap a weak hash in typed_hash_map_mix).
+***
+*******************************************************************************/
+
+#ifndef TYPED_HASH_MAP_H__
+#define TYPED_HASH_MAP_H__
+
+#include <inttypes.h>       /* uint64_t */
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef SET_TRUE
+#define SET_TRUE 0
+#define SET_FALSE -1
+#define SET_MALLOC_ERROR -2
+#endif
+
+#define TYPED_HASH_MAP_MIN_SIZE 8
+
+/*  How many keys ahead batched callers should name_prefetch */
+#define TYPED_HASH_MAP_PREFETCH_DISTANCE 8
+
+/*  64 bit finalizer from MurmurHash3, for hash_fn that do not mix well on
+    their own; tables are powers of two and use the low bits of the hash as
+    the home slot */
+static inline uint64_t typed_hash_map_mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/*  Declare the node and map types plus the functions of a typed hash map.
+
+    _dist is one more than how far the node sits from its home slot (Robin
+    Hood probing); 0 marks an empty slot. A node is only live while its _gen
+    matches the map's generation, which is how name_clear empties the map
+    without touching the table.
+
+    name_init       Initialize the map to hold init_size keys without growing
+    name_init_hash  name_init, but hash keys with hash instead of hash_fn
+                    (e.g. a hash picked at run time); NULL means hash_fn
+    name_destroy    Free the node table (values are not freed)
+    name_clear      Remove every key in O(1) (values are not freed)
+    name_slot_used  Non-zero if slot index of the node table holds a key
+    name_get        Pointer to the value stored for key, or NULL
+    name_put        Pointer to the value stored for key, inserting the key
+                    with a zeroed value if it is not present yet; *added is
+                    set to 1 if the key was inserted and 0 if it was present.
+                    Returns NULL on malloc failure
+    name_remove     SET_TRUE if the key was removed, SET_FALSE if not present
+    name_length     Number of keys in the map
+    name_reserve    Grow the map so that n_keys more keys fit without growing
+                    again; SET_TRUE or SET_MALLOC_ERROR
+    name_prefetch   Pull the home slot of key into cache ahead of a lookup
+    name_get_many   values[i] = name_get(map, keys[i]) for n keys, prefetching
+                    TYPED_HASH_MAP_PREFETCH_DISTANCE keys ahead
+    name_count_common
+                    Number of keys in both a and b, found by looking the
+                    keys of the smaller map up in the larger one
+
+    Pointers returned by name_get and name_put are only valid until the next
+    name_put or name_remove. */
+#define TYPED_HASH_MAP_DECLARE(name, key_t, value_t)                            \
+    typedef struct {                                                            \
+        key_t _key;                                                             \
+        value_t _data;                                                          \
+        uint32_t _dist;                                                         \
+        uint32_t _gen;                                                          \
+    } name##_node;                                                              \
+                                                                                \
+    typedef struct {                                                            \
+        name##_node *nodes;                                                     \
+        uint64_t number_nodes;                                                  \
+        uint64_t used_nodes;                                                    \
+        uint64_t n_collisions;                                                  \
+        uint64_t (*hash_function)(key_t key);                                   \
+        uint32_t generation;                                                    \
+    } name;                                                                     \
+                                                                                \
+    static inline int name##_slot_used(const name *map, uint64_t index) {       \
+        return map->nodes[index]._gen == map->generation                        \
+            && map->nodes[index]._dist != 0;                                    \
+    }                                                                           \
+                                                                                \
+    int name##_init(name *map, uint64_t init_size);                             \
+    int name##_init_hash(name *map, uint64_t init_size,                         \
+            uint64_t (*hash)(key_t key));                                       \
+    void name##_destroy(name *map);                                             \
+    void name##_clear(name *map);                                               \
+    value_t *name##_get(name *map, key_t key);                                  \
+    value_t *name##_put(name *map, key_t key, int *added);                      \
+    int name##_remove(name *map, key_t key);                                    \
+    uint64_t name##_length(name *map);                                          \
+    int name##_reserve(name *map, uint64_t n_keys);                             \
+    void name##_prefetch(name *map, key_t key);                                 \
+    void name##_get_many(name *map, const key_t *keys, uint64_t n,              \
+            value_t **values);                                                  \
+    uint64_t name##_count_common(name *a, name *b);
+
+/*  Define the functions declared by TYPED_HASH_MAP_DECLARE */
+#define TYPED_HASH_MAP_IMPL(name, key_t, value_t, hash_fn, equals_fn)          \
+    static inline uint64_t name##__home(name *map, key_t key) {                 \
+        uint64_t hash = (map->hash_function != NULL)                            \
+            ? map->hash_function(key) : hash_fn(key);                           \
+        return hash & (map->number_nodes - 1);                                  \
+    }                                                                           \
+                                                                                \
+    /* _dist of a node, or 0 if it was left over from before a clear */        \
+    static inline uint32_t name##__dist(const name *map,                        \
+            const name##_node *node) {                                          \
+        return (node->_gen == map->generation) ? node->_dist : 0;               \
+    }                                                                           \
+                                                                                \
+    static inline name##_node *name##__find(name *map, key_t key) {             \
+        uint64_t mask = map->number_nodes - 1;                                  \
+        uint64_t i = name##__home(map, key);                                    \
+        uint32_t dist = 1;                                                      \
+        while (1) {                                                             \
+            name##_node *node = &map->nodes[i];                                 \
+            if (name##__dist(map, node) < dist) {                               \
+                return NULL;                                                    \
+            }                                                                   \
+            if (equals_fn(node->_key, key)) {                                   \
+                return node;                                                    \
+            }                                                                   \
+            i = (i + 1) & mask;                                                 \
+            dist++;                                                             \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    /* Robin Hood insert of a key known to be absent; returns its slot */      \
+    static inline uint64_t name##__insert(name *map, name##_node entry) {       \
+        uint64_t mask = map->number_nodes - 1;                                  \
+        uint64_t i = name##__home(map, entry._key), slot;                       \
+        name##_node carry;                                                      \
+        entry._dist = 1;                                                        \
+        entry._gen = map->generation;                                           \
+        while (name##__dist(map, &map->nodes[i]) >= entry._dist) {              \
+            i = (i + 1) & mask;                                                 \
+            entry._dist++;                                                      \
+        }                                                                       \
+        slot = i;                                                               \
+        carry = map->nodes[i];                                                  \
+        carry._dist = name##__dist(map, &carry);                                \
+        map->nodes[i] = entry;                                                  \
+        while (carry._dist != 0) {                                              \
+            i = (i + 1) & mask;                                                 \
+            carry._dist++;                                                      \
+            if (name##__dist(map, &map->nodes[i]) < carry._dist) {              \
+                name##_node tmp = map->nodes[i];                                \
+                tmp._dist = name##__dist(map, &tmp);                            \
+                map->nodes[i] = carry;                                          \
+                carry = tmp;                                                    \
+            }                                                                   \
+        }                                                                       \
+        return slot;                                                            \
+    }                                                                           \
+                                                                                \
+    static int name##__resize(name *map, uint64_t num_els) {                    \
+        name##_node *old_nodes = map->nodes;                                    \
+        uint64_t i, old_num_els = map->number_nodes;                            \
+        map->nodes = (name##_node *) calloc(num_els, sizeof(name##_node));      \
+        if (map->nodes == NULL) {                                               \
+            map->nodes = old_nodes;                                             \
+            return SET_MALLOC_ERROR;                                            \
+        }                                                                       \
+        map->number_nodes = num_els;                                            \
+        for (i = 0; i < old_num_els; i++) {                                     \
+            if (name##__dist(map, &old_nodes[i]) != 0) {                        \
+                name##__insert(map, old_nodes[i]);                              \
+            }                                                                   \
+        }                                                                       \
+        free(old_nodes);                                                        \
+        return SET_TRUE;                                                        \
+    }                                                                           \
+                                                                                \
+    int name##_init(name *map, uint64_t init_size) {                            \
+        return name##_init_hash(map, init_size, NULL);                          \
+    }                                                                           \
+                                                                                \
+    int name##_init_hash(name *map, uint64_t init_size,                         \
+            uint64_t (*hash)(key_t key)) {                                      \
+        uint64_t num_els = TYPED_HASH_MAP_MIN_SIZE;                             \
+        while (num_els * 3 < init_size * 4) {                                   \
+            num_els <<= 1;                                                      \
+        }                                                                       \
+        map->nodes = (name##_node *) calloc(num_els, sizeof(name##_node));      \
+        if (map->nodes == NULL) {                                               \
+            return SET_MALLOC_ERROR;                                            \
+        }                                                                       \
+        map->number_nodes = num_els;                                            \
+        map->used_nodes = 0;                                                    \
+        map->n_collisions = 0;                                                  \
+        map->hash_function = hash;                                              \
+        map->generation = 1;                                                    \
+        return SET_TRUE;                                                        \
+    }                                                                           \
+                                                                                \
+    void name##_destroy(name *map) {                                            \
+        free(map->nodes);                                                       \
+        map->nodes = NULL;                                                      \
+        map->number_nodes = 0;                                                  \
+        map->used_nodes = 0;                                                    \
+    }                                                                           \
+                                                                                \
+    void name##_clear(name *map) {                                              \
+        /* retire every node at once; wipe the table only when the             \
+           generation wraps back around to the zeroed nodes' 0 */              \
+        if (++map->generation == 0) {                                           \
+            memset(map->nodes, 0, map->number_nodes * sizeof(name##_node));     \
+            map->generation = 1;                                                \
+        }                                                                       \
+        map->used_nodes = 0;                                                    \
+        map->n_collisions = 0;                                                  \
+    }                                                                           \
+                                                                                \
+    value_t *name##_get(name *map, key_t key) {                                 \
+        name##_node *node = name##__find(map, key);                             \
+        return (node == NULL) ? NULL : &node->_data;                            \
+    }                                                                           \
+                                                                                \
+    value_t *name##_put(name *map, key_t key, int *added) {                     \
+        name##_node *node = name##__find(map, key);                             \
+        name##_node entry;                                                      \
+        uint64_t slot;                                                          \
+        if (node != NULL) {                                                     \
+            *added = 0;                                                         \
+            return &node->_data;                                                \
+        }                                                                       \
+        /* grow once the map would be more than 3/4 full */                     \
+        if ((map->used_nodes + 1) * 4 > map->number_nodes * 3) {                \
+            if (name##__resize(map, map->number_nodes * 2) != SET_TRUE) {       \
+                return NULL;                                                    \
+            }                                                                   \
+        }                                                                       \
+        memset(&entry, 0, sizeof(entry));                                       \
+        entry._key = key;                                                       \
+        slot = name##__insert(map, entry);                                      \
+        if (map->nodes[slot]._dist != 1) {                                      \
+            map->n_collisions++;                                                \
+        }                                                                       \
+        map->used_nodes++;                                                      \
+        *added = 1;                                                             \
+        return &map->nodes[slot]._data;                                         \
+    }                                                                           \
+                                                                                \
+    int name##_remove(name *map, key_t key) {                                   \
+        uint64_t mask = map->number_nodes - 1;                                  \
+        name##_node *node = name##__find(map, key);                             \
+        uint64_t i, next;                                                       \
+        if (node == NULL) {                                                     \
+            return SET_FALSE;                                                   \
+        }                                                                       \
+        /* shift the displaced nodes that follow back into the hole */         \
+        i = (uint64_t) (node - map->nodes);                                     \
+        next = (i + 1) & mask;                                                  \
+        while (name##__dist(map, &map->nodes[next]) > 1) {                      \
+            map->nodes[i] = map->nodes[next];                                   \
+            map->nodes[i]._dist--;                                              \
+            i = next;                                                           \
+            next = (i + 1) & mask;                                              \
+        }                                                                       \
+        memset(&map->nodes[i], 0, sizeof(name##_node));                         \
+        map->used_nodes--;                                                      \
+        return SET_TRUE;                                                        \
+    }                                                                           \
+                                                                                \
+    uint64_t name##_length(name *map) {                                         \
+        return map->used_nodes;                                                 \
+    }                                                                           \
+                                                                                \
+    int name##_reserve(name *map, uint64_t n_keys) {                            \
+        uint64_t num_els = map->number_nodes;                                   \
+        while ((map->used_nodes + n_keys) * 4 > num_els * 3) {                  \
+            num_els <<= 1;                                                      \
+        }                                                                       \
+        if (num_els == map->number_nodes) {                                     \
+            return SET_TRUE;                                                    \
+        }                                                                       \
+        return name##__resize(map, num_els);                                    \
+    }                                                                           \
+                                                                                \
+    void name##_prefetch(name *map, key_t key) {                                \
+        __builtin_prefetch(&map->nodes[name##__home(map, key)], 1, 1);          \
+    }                                                                           \
+                                                                                \
+    void name##_get_many(name *map, const key_t *keys, uint64_t n,             \
+            value_t **values) {                                                 \
+        uint64_t i, ahead = TYPED_HASH_MAP_PREFETCH_DISTANCE;                   \
+        for (i = 0; i < n && i < ahead; i++) {                                  \
+            name##_prefetch(map, keys[i]);                                      \
+        }                                                                       \
+        for (i = 0; i < n; i++) {                                               \
+            if (i + ahead < n) {                                                \
+                name##_prefetch(map, keys[i + ahead]);                          \
+            }                                                                   \
+            values[i] = name##_get(map, keys[i]);                               \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    uint64_t name##_count_common(name *a, name *b) {                            \
+        name *small = (b->used_nodes < a->used_nodes) ? b : a;                  \
+        name *large = (small == a) ? b : a;                                     \
+        uint64_t i, count = 0;                                                  \
+        for (i = 0; i < small->number_nodes; i++) {                             \
+            if (name##_slot_used(small, i)                                      \
+                    && name##__find(large, small->nodes[i]._key) != NULL) {     \
+                count++;                                                        \
+            }                                                                   \
+        }                                                                       \
+        return count;                                                           \
+    }
+
+#endif /* END TYPED_HASH_MAP_H__ */
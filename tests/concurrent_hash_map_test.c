@@ -0,0 +1,227 @@
+#include "timing.h"
+#include "../src/concurrent_hash_map.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define ELEMENTS 1000000
+#define OVERLAP 10000
+#define THREADS 4
+#define READ_ELEMENTS 200000
+#define READ_ROUNDS 4
+
+#define KNRM  "\x1B[0m"
+#define KRED  "\x1B[31m"
+#define KGRN  "\x1B[32m"
+
+typedef uint32_t item;
+
+
+void success_or_failure(int res) {
+    if (res == 1) {
+        printf(KGRN "success!\n" KNRM);
+    } else {
+        printf(KRED "failure!\n" KNRM);
+    }
+}
+
+static uint64_t item_hash(void *_key, void *_global) {
+    use(_global);
+    uint8_t *bytes = (uint8_t *) _key;
+    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
+    uint64_t h = 14695981039346656073ULL; // FNV_OFFSET 64 bit
+    for (uint32_t i = 0; i < sizeof(item); i++) {
+        h = h ^ bytes[i];
+        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
+    }
+    return h;
+}
+
+static void *item_copy(void *_key, void *_global) {
+    use(_global);
+    item *copy = malloc(sizeof(item));
+    *copy = *(item *) _key;
+    return copy;
+}
+
+static void item_free(void *key, void *_global) {
+    use(_global);
+    free(key);
+}
+
+static int item_equals(void *_key_1, void *_key_2, void *_global) {
+    use(_global);
+    return *(item *) _key_1 == *(item *) _key_2;
+}
+
+/*  One thread's work: add every n_threads-th key plus the first OVERLAP keys
+    that every thread adds, either to the concurrent set or (the old pattern)
+    to one SimpleSet behind one lock */
+typedef struct {
+    ConcurrentSet *set;
+    SimpleSet *locked;
+    pthread_mutex_t *lock;
+    uint32_t thread;
+    uint32_t n_threads;
+    int errors;
+} ingest_part;
+
+static void *ingest(void *arg) {
+    ingest_part *part = arg;
+    uint32_t i;
+    for (i = part->thread; i < ELEMENTS + OVERLAP; i += part->n_threads) {
+        item key = (i < ELEMENTS) ? i : i - ELEMENTS;
+        void *data = (void *) (uintptr_t) (key + 1);
+        int res;
+        if (part->set != NULL) {
+            res = concurrent_set_add_with_data(part->set, &key, data);
+        } else {
+            pthread_mutex_lock(part->lock);
+            res = set_add_with_data(part->locked, &key, data);
+            pthread_mutex_unlock(part->lock);
+        }
+        part->errors += (res != SET_TRUE && res != SET_ALREADY_PRESENT);
+    }
+    return NULL;
+}
+
+/*  Run ingest on n_threads threads; returns the number of failed adds */
+static int run_ingest(ConcurrentSet *set, SimpleSet *locked, uint32_t n_threads, double *seconds) {
+    pthread_t threads[THREADS];
+    ingest_part parts[THREADS];
+    pthread_mutex_t lock;
+    Timing t;
+    uint32_t i;
+    int errors = 0;
+    pthread_mutex_init(&lock, NULL);
+    timing_start(&t);
+    for (i = 0; i < n_threads; i++) {
+        parts[i].set = set;
+        parts[i].locked = locked;
+        parts[i].lock = &lock;
+        parts[i].thread = i;
+        parts[i].n_threads = n_threads;
+        parts[i].errors = 0;
+        pthread_create(&threads[i], NULL, ingest, &parts[i]);
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+        errors += parts[i].errors;
+    }
+    timing_end(&t);
+    *seconds = timing_get_difference(t);
+    pthread_mutex_destroy(&lock);
+    return errors;
+}
+
+/*  Readers check keys no writer touches while writers add new keys (growing
+    the shards) and remove the odd preloaded ones */
+typedef struct {
+    ConcurrentSet *set;
+    uint32_t thread;
+    uint64_t misses;
+} read_part;
+
+static void *write_keys(void *arg) {
+    read_part *part = arg;
+    uint32_t i;
+    for (i = part->thread; i < READ_ELEMENTS; i += 2) {
+        item key = READ_ELEMENTS + i;
+        concurrent_set_add_with_data(part->set, &key, (void *) (uintptr_t) (key + 1));
+        if (i % 2 == 1) {
+            key = i;
+            concurrent_set_remove(part->set, &key);
+        }
+    }
+    return NULL;
+}
+
+static void *read_keys(void *arg) {
+    read_part *part = arg;
+    uint32_t round, i;
+    for (round = 0; round < READ_ROUNDS; round++) {
+        for (i = 0; i < READ_ELEMENTS; i += 2) {
+            item key = i;
+            void *data = NULL;
+            if (concurrent_set_get_data(part->set, &key, &data) != SET_TRUE || data != (void *) (uintptr_t) (key + 1)) {
+                part->misses++;
+            }
+            key = 3 * READ_ELEMENTS + i;
+            if (concurrent_set_contains(part->set, &key) != SET_FALSE) {
+                part->misses++;
+            }
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    ConcurrentSet set;
+    SimpleSet locked;
+    double one_thread, many_threads, one_lock;
+    uint64_t i, wrong = 0;
+    int errors;
+
+    printf("==== Concurrent Set Ingest ====\n");
+    concurrent_set_init(&set, NULL, 0, 0, item_hash, item_equals, item_copy, item_free);
+    errors = run_ingest(&set, NULL, 1, &one_thread);
+    concurrent_set_destroy(&set);
+    concurrent_set_init(&set, NULL, 0, 0, item_hash, item_equals, item_copy, item_free);
+    errors += run_ingest(&set, NULL, THREADS, &many_threads);
+    set_init(&locked, NULL, 1024, item_hash, item_equals, item_copy, item_free);
+    errors += run_ingest(NULL, &locked, THREADS, &one_lock);
+    printf("%d keys from 1 thread %f seconds, from %d threads %f seconds; one locked set from %d threads %f seconds\n",
+           ELEMENTS, one_thread, THREADS, many_threads, THREADS, one_lock);
+    for (i = 0; i < ELEMENTS; i++) {
+        item key = (item) i;
+        void *data = NULL;
+        if (concurrent_set_get_data(&set, &key, &data) != SET_TRUE || data != (void *) (uintptr_t) (i + 1)) {
+            wrong++;
+        }
+    }
+    printf("Every key added once with its data: ");
+    success_or_failure(errors == 0 && wrong == 0 && concurrent_set_length(&set) == ELEMENTS
+                       && set_length(&locked) == ELEMENTS);
+    set_destroy(&locked);
+    concurrent_set_destroy(&set);
+
+    printf("\n\n==== Lock-free Readers ====\n");
+    pthread_t threads[THREADS];
+    read_part parts[THREADS];
+    concurrent_set_init(&set, NULL, READ_ELEMENTS, THREADS, item_hash, item_equals, item_copy, item_free);
+    for (i = 0; i < READ_ELEMENTS; i++) {
+        item key = (item) i;
+        concurrent_set_add_with_data(&set, &key, (void *) (uintptr_t) (i + 1));
+    }
+    for (i = 0; i < THREADS; i++) {
+        parts[i].set = &set;
+        parts[i].thread = (uint32_t) i % 2;
+        parts[i].misses = 0;
+        pthread_create(&threads[i], NULL, (i < 2) ? write_keys : read_keys, &parts[i]);
+    }
+    wrong = 0;
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        wrong += parts[i].misses;
+    }
+    printf("Readers saw every untouched key while the shards grew: ");
+    success_or_failure(wrong == 0);
+    for (i = 0; i < READ_ELEMENTS; i++) {
+        item key = (item) i;
+        wrong += concurrent_set_contains(&set, &key) != ((i % 2 == 0) ? SET_TRUE : SET_FALSE);
+    }
+    printf("Removed keys are gone and the rest remain: ");
+    success_or_failure(wrong == 0 && concurrent_set_length(&set) == READ_ELEMENTS * 3 / 2);
+    concurrent_set_reclaim(&set);
+    printf("Lookups still work after reclaiming: ");
+    item key = 0;
+    success_or_failure(concurrent_set_contains(&set, &key) == SET_TRUE
+                       && concurrent_set_remove(&set, &key) == SET_TRUE
+                       && concurrent_set_contains(&set, &key) == SET_FALSE);
+    concurrent_set_destroy(&set);
+
+    printf("\n\n==== Completed tests! ====\n");
+    return 0;
+}
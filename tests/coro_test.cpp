@@ -0,0 +1,144 @@
+#include "../src/hash_map_coro.hpp"
+#include "../src/map_of_bitset_coro.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define ELEMENTS 400000
+#define IN_FLIGHT 8
+
+#define KNRM  "\x1B[0m"
+#define KRED  "\x1B[31m"
+#define KGRN  "\x1B[32m"
+
+typedef uint32_t item;
+
+void success_or_failure(int res) {
+    if (res == 1) {
+        printf(KGRN "success!\n" KNRM);
+    } else {
+        printf(KRED "failure!\n" KNRM);
+    }
+}
+
+static uint64_t item_hash(void *_key, void *_global) {
+    use(_global);
+    uint8_t *bytes = (uint8_t *) _key;
+    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
+    uint64_t h = 14695981039346656073ULL; // FNV_OFFSET 64 bit
+    for (uint32_t i = 0; i < sizeof(item); i++) {
+        h = h ^ bytes[i];
+        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
+    }
+    return h;
+}
+
+static void *item_copy(void *_key, void *_global) {
+    use(_global);
+    item *copy = (item *) malloc(sizeof(item));
+    *copy = *(item *) _key;
+    return copy;
+}
+
+static void item_free(void *key, void *_global) {
+    use(_global);
+    free(key);
+}
+
+static int item_equals(void *_key_1, void *_key_2, void *_global) {
+    use(_global);
+    return *(item *) _key_1 == *(item *) _key_2;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    uint64_t i, lookups = ELEMENTS * 2;
+    int inaccuraces = 0;
+
+    printf("==== SimpleSet Coroutine Lookups ====\n");
+    SimpleSet A;
+    set_init(&A, NULL, ELEMENTS, item_hash, item_equals, item_copy, item_free);
+    for (i = 0; i < ELEMENTS; i++) {
+        item key = (item) i;
+        set_add_with_data(&A, &key, (void *) (uintptr_t) (i + 1));
+    }
+    std::vector<item> keys(lookups);
+    std::vector<int> expected(lookups), results(lookups);
+    std::vector<void *> datas(lookups);
+    srand(1);
+    for (i = 0; i < lookups; i++) {
+        keys[i] = (item) (((uint64_t) rand() * RAND_MAX + rand()) % lookups);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (i = 0; i < lookups; i++) {
+        expected[i] = set_contains(&A, &keys[i]);
+    }
+    printf("%" PRIu64 " set_contains calls in %f seconds\n", lookups, seconds_since(start));
+    start = std::chrono::steady_clock::now();
+    interleave(IN_FLIGHT, lookups,
+        [&](uint64_t k) { return set_coro::contains(&A, &keys[k]); },
+        [&](uint64_t k, int res) { results[k] = res; });
+    printf("%" PRIu64 " interleaved lookups in %f seconds\n", lookups, seconds_since(start));
+    for (i = 0; i < lookups; i++) {
+        if (results[i] != expected[i]) {
+            inaccuraces++;
+        }
+    }
+    printf("Interleaved contains agrees with set_contains: ");
+    success_or_failure(inaccuraces == 0);
+
+    inaccuraces = 0;
+    interleave(IN_FLIGHT, lookups,
+        [&](uint64_t k) { return set_coro::get_data(&A, &keys[k]); },
+        [&](uint64_t k, void *data) { datas[k] = data; });
+    for (i = 0; i < lookups; i++) {
+        void *want = (keys[i] < ELEMENTS) ? (void *) (uintptr_t) (keys[i] + 1) : NULL;
+        if (datas[i] != want) {
+            inaccuraces++;
+        }
+    }
+    printf("Interleaved get_data returns the stored data: ");
+    success_or_failure(inaccuraces == 0);
+    set_destroy(&A);
+
+    printf("\n\n==== Coordinate Map Coroutine Lookups ====\n");
+    map_key_n_dims n_dims = 2;
+    coordinate_map *map = init_map(&n_dims, ELEMENTS);
+    std::vector<map_key> coords(lookups);
+    for (i = 0; i < lookups; i++) {
+        coords[i] = make_2d(rand() & 0x3FF, rand() & 0x3FF);
+        if (i % 2 == 0) {
+            add_item(map, coords[i], i % MAP_LABEL_BITS);
+        }
+    }
+    inaccuraces = 0;
+    interleave(IN_FLIGHT, lookups,
+        [&](uint64_t k) { return map_coro::label_mask(map, coords[k]); },
+        [&](uint64_t k, label_bitset mask) {
+            label_bitset want = get_label_mask(map, coords[k]);
+            if (memcmp(&mask, &want, sizeof(mask)) != 0) {
+                inaccuraces++;
+            }
+        });
+    contains_items(map, coords.data(), lookups, expected.data());
+    interleave(IN_FLIGHT, lookups,
+        [&](uint64_t k) { return map_coro::contains(map, coords[k]); },
+        [&](uint64_t k, int found) {
+            if (found != expected[k]) {
+                inaccuraces++;
+            }
+        });
+    printf("Interleaved label lookups agree with get_label_mask: ");
+    success_or_failure(inaccuraces == 0);
+    destroy_map(map);
+
+    printf("\n\n==== Completed tests! ====\n");
+    return 0;
+}
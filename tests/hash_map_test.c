@@ -108,6 +108,26 @@ void initialize_set(SimpleSet *set, int start, int elements, int itter, int TEST
     }
 }
 
+typedef int (*in_place_op)(SimpleSet *dest, SimpleSet *other);
+typedef int (*set_op)(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
+
+/*  Run update(dest, other) on dest = [d_start, d_end) and other =
+    [o_start, o_end); 1 if dest ends up equal to op(dest, other) */
+static int check_in_place(in_place_op update, set_op op, int d_start, int d_end, int o_start, int o_end, item_n_dims *n_dims) {
+    SimpleSet dest, other, expected;
+    set_init(&dest, n_dims, 1024, item_hash, item_equals, item_copy, item_free);
+    set_init(&other, n_dims, 1024, item_hash, item_equals, item_copy, item_free);
+    set_init(&expected, n_dims, 1024, item_hash, item_equals, item_copy, item_free);
+    initialize_set(&dest, d_start, d_end, 1, SET_TRUE);
+    initialize_set(&other, o_start, o_end, 1, SET_TRUE);
+    op(&expected, &dest, &other);
+    int res = update(&dest, &other) == SET_TRUE && set_cmp(&dest, &expected) == SET_EQUAL;
+    set_destroy(&dest);
+    set_destroy(&other);
+    set_destroy(&expected);
+    return res;
+}
+
 int main() {
     Timing t;
     timing_start(&t);
@@ -134,6 +154,7 @@ int main() {
     // free the keys memory
     for (i = 0; i < ui; i++) {
         free(keys[i]->index);
+        free(keys[i]);
     }
     free(keys);
 
@@ -170,6 +191,7 @@ int main() {
             printf("Missing Key: [%d]\n", key.label);
             inaccuraces++;
         }
+        free_key(key);
     }
     success_or_failure(inaccuraces == 0);
 
@@ -225,7 +247,7 @@ int main() {
     set_clear(&A);
     inaccuraces = 0;
     for(ui=0; ui < A.number_nodes; ui++) {
-        if (A.nodes[ui] != NULL) {
+        if (A.nodes[ui]._key != NULL) {
             inaccuraces++;
         }
     }
@@ -465,6 +487,61 @@ int main() {
     res = set_cmp(&A, &B);
     success_or_failure(res == SET_UNEQUAL);
 
+    printf("\n\n==== Test In Place Set Algebra ====\n");
+    printf("set_union_into matches set_union: ");
+    success_or_failure(check_in_place(set_union_into, set_union, 0, 1000, 500, 5000, &n_dims));
+    printf("set_intersect_update matches set_intersection (smaller dest): ");
+    success_or_failure(check_in_place(set_intersect_update, set_intersection, 0, 1000, 500, 5000, &n_dims));
+    printf("set_intersect_update matches set_intersection (smaller other): ");
+    success_or_failure(check_in_place(set_intersect_update, set_intersection, 0, 5000, 4500, 5500, &n_dims));
+    printf("set_difference_update matches set_difference (smaller dest): ");
+    success_or_failure(check_in_place(set_difference_update, set_difference, 0, 1000, 500, 5000, &n_dims));
+    printf("set_difference_update matches set_difference (smaller other): ");
+    success_or_failure(check_in_place(set_difference_update, set_difference, 0, 5000, 4500, 5500, &n_dims));
+    printf("set_symmetric_difference_update matches set_symmetric_difference: ");
+    success_or_failure(check_in_place(set_symmetric_difference_update, set_symmetric_difference, 0, 1000, 500, 5000, &n_dims));
+    printf("set_difference_update of a set with itself empties it: ");
+    set_clear(&C);
+    set_union_into(&C, &A);
+    success_or_failure(set_difference_update(&C, &C) == SET_TRUE && C.used_nodes == 0);
+
+    printf("\n\n==== Test Skewed Set Algebra ====\n");
+    SimpleSet Big, Small, Left, Right;
+    set_init(&Big, &n_dims, 1024, item_hash, item_equals, item_copy, item_free);
+    set_init(&Small, &n_dims, 1024, item_hash, item_equals, item_copy, item_free);
+    set_init(&Left, &n_dims, 1024, item_hash, item_equals, item_copy, item_free);
+    set_init(&Right, &n_dims, 1024, item_hash, item_equals, item_copy, item_free);
+    initialize_set(&Big, 0, elements, 1, SET_TRUE);
+    initialize_set(&Small, elements - 10, elements + 10, 1, SET_TRUE);
+    set_intersection(&Left, &Big, &Small);
+    set_intersection(&Right, &Small, &Big);
+    printf("Intersection is the same whichever set is smaller: ");
+    success_or_failure(Left.used_nodes == 10 && set_cmp(&Left, &Right) == SET_EQUAL);
+    printf("A larger set is never a subset: ");
+    success_or_failure(set_is_subset(&Big, &Small) == SET_FALSE && set_is_superset(&Small, &Big) == SET_FALSE);
+    set_clear(&Left);
+    ui = Left.number_nodes;
+    set_reserve(&Left, elements);
+    res = (Left.number_nodes != ui);
+    ui = Left.number_nodes;
+    initialize_set(&Left, 0, elements, 1, SET_TRUE);
+    printf("set_reserve makes room for every key up front: ");
+    success_or_failure(res && Left.number_nodes == ui);
+
+    printf("\n\n==== Test Count Only Set Algebra ====\n");
+    printf("set_intersection_count matches set_intersection: ");
+    success_or_failure(set_intersection_count(&Big, &Small) == Right.used_nodes
+                       && set_intersection_count(&A, &B) == elements - 1);
+    printf("set_union_count counts shared keys once: ");
+    success_or_failure(set_union_count(&A, &B) == elements + 1 && set_union_count(&Small, &Big) == elements + 10);
+    printf("set_difference_count counts keys only in the first set: ");
+    success_or_failure(set_difference_count(&A, &B) == 1 && set_difference_count(&Small, &Big) == 10
+                       && set_difference_count(&Big, &Small) == elements - 10);
+    set_destroy(&Big);
+    set_destroy(&Small);
+    set_destroy(&Left);
+    set_destroy(&Right);
+
     printf("\n\n==== Clean Up Memory ====\n");
     set_destroy(&A);
     set_destroy(&B);
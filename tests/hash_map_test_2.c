@@ -1,6 +1,7 @@
 
 #include "timing.h"
 #include "../src/hash_map.h"
+#include "../src/set_hash.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -8,6 +9,18 @@
 #include <assert.h>
 
 #define KEY_LEN 25
+#define CHURN_ROUNDS 8
+#define REHASH_ELEMENTS 8
+#define PROBE_BINS 8
+#define ARENA_FRAMES 16
+#define PARALLEL_ELEMENTS 1000000
+#define PARALLEL_THREADS 4
+
+/*  Keys in the lookup benchmark; raise it (e.g. -DLOOKUP_ELEMENTS=200000000)
+    to time tables well beyond the last level cache */
+#ifndef LOOKUP_ELEMENTS
+#define LOOKUP_ELEMENTS 400000
+#endif
 
 #define KNRM  "\x1B[0m"
 #define KRED  "\x1B[31m"
@@ -47,6 +60,21 @@ static uint64_t item_hash(void *_key, void *_global) {
     return h;
 }
 
+static uint64_t item_hash_murmur3(void *_key, void *_global) {
+    use(_global);
+    return set_hash_murmur3(*(item *) _key);
+}
+
+static uint64_t item_hash_multiply_xorshift(void *_key, void *_global) {
+    use(_global);
+    return set_hash_int(*(item *) _key);
+}
+
+static uint64_t item_hash_wyhash(void *_key, void *_global) {
+    use(_global);
+    return set_hash_bytes(_key, sizeof(item));
+}
+
 static void *item_copy(void *_key, void *_global) {
     use(_global);
     item *key = _key;
@@ -78,6 +106,38 @@ void free_key(item key) {
     use(key);
 }
 
+/*  Insert and look up LOOKUP_ELEMENTS keys spaced 64 apart (so the low bits
+    of every key are equal) with hash, then print the time taken and the
+    probe length histogram */
+void hash_benchmark(const char *name, key_hash_function hash) {
+    SimpleSet set;
+    Timing bench;
+    uint64_t i, histogram[PROBE_BINS], max_probe, found = 0;
+    set_init(&set, NULL, LOOKUP_ELEMENTS, hash, item_equals, item_copy, item_free);
+    timing_start(&bench);
+    for (i = 0; i < LOOKUP_ELEMENTS; i++) {
+        item key = make_key(i * 64);
+        set_add(&set, &key);
+    }
+    for (i = 0; i < LOOKUP_ELEMENTS * 2; i++) {
+        item key = make_key(i * 64);
+        found += (set_contains(&set, &key) == SET_TRUE);
+    }
+    timing_end(&bench);
+    max_probe = set_probe_histogram(&set, histogram, PROBE_BINS);
+    printf("%-18s %f seconds, probe lengths (max %" PRIu64 "):", name, timing_get_difference(bench), max_probe);
+    for (i = 0; i < PROBE_BINS; i++) {
+        printf(" %" PRIu64, histogram[i]);
+    }
+    printf("%s\n", (found == LOOKUP_ELEMENTS) ? "" : " (lookups disagree!)");
+    set_destroy(&set);
+}
+
+static void sum_items(void *key, void *data, void *context) {
+    use(data);
+    *(uint64_t *) context += *(item *) key;
+}
+
 void initialize_set(SimpleSet *set, int start, int elements, int itter, int TEST) {
     int i;
     for (i = start; i < elements; i+=itter) {
@@ -90,6 +150,48 @@ void initialize_set(SimpleSet *set, int start, int elements, int itter, int TEST
     }
 }
 
+/* Insert keys [0, elements) and return the slowest single insert in seconds */
+double slowest_insert(SimpleSet *set, uint64_t elements) {
+    uint64_t i;
+    double slowest = 0.0;
+    for (i = 0; i < elements; i++) {
+        Timing ins;
+        item key = make_key(i);
+        timing_start(&ins);
+        set_add(set, &key);
+        timing_end(&ins);
+        if (timing_get_difference(ins) > slowest) {
+            slowest = timing_get_difference(ins);
+        }
+    }
+    return slowest;
+}
+
+/*  Build a set of keys [0, elements) with the given flags, then look up twice
+    as many keys; returns the number of wrong answers */
+int time_index_mode(const char *name, int flags, uint64_t elements) {
+    SimpleSet set;
+    Timing build, lookup;
+    uint64_t i;
+    int wrong = 0;
+    set_init_alt(&set, NULL, 1024, item_hash, item_equals, item_copy, item_free, flags);
+    timing_start(&build);
+    initialize_set(&set, 0, elements, 1, SET_TRUE);
+    timing_end(&build);
+    timing_start(&lookup);
+    for (i = 0; i < elements * 2; i++) {
+        item key = make_key(i);
+        if ((set_contains(&set, &key) == SET_TRUE) != (i < elements)) {
+            wrong++;
+        }
+    }
+    timing_end(&lookup);
+    printf("%-12s %" PRIu64 " slots: build %f seconds, lookups %f seconds\n", name, set.number_nodes,
+        timing_get_difference(build), timing_get_difference(lookup));
+    set_destroy(&set);
+    return wrong;
+}
+
 int main() {
     Timing t;
     timing_start(&t);
@@ -206,7 +308,7 @@ int main() {
     set_clear(&A);
     inaccuraces = 0;
     for(ui=0; ui < A.number_nodes; ui++) {
-        if (A.nodes[ui] != NULL) {
+        if (A.nodes[ui]._key != NULL) {
             inaccuraces++;
         }
     }
@@ -446,6 +548,361 @@ int main() {
     res = set_cmp(&A, &B);
     success_or_failure(res == SET_UNEQUAL);
 
+    /*  Test incremental rehash: the set keeps working while nodes are still
+        being migrated out of the old table, and no single insert has to move
+        the whole table */
+    printf("\n\n==== Test Incremental Rehash ====\n");
+    SimpleSet D;
+    double slowest;
+    set_init(&D, NULL, 1024, item_hash, item_equals, item_copy, item_free);
+    slowest = slowest_insert(&D, elements * REHASH_ELEMENTS);
+    printf("Slowest insert with a full rehash: %f seconds\n", slowest);
+    set_destroy(&D);
+    set_init_alt(&D, NULL, 1024, item_hash, item_equals, item_copy, item_free, SET_INCREMENTAL_REHASH);
+    slowest = slowest_insert(&D, elements * REHASH_ELEMENTS);
+    printf("Slowest insert with an incremental rehash: %f seconds\n", slowest);
+    // keep adding until the next rehash starts so the checks below begin mid-migration
+    for (ui = elements * REHASH_ELEMENTS; D.old_nodes == NULL; ui++) {
+        item key = make_key(ui);
+        set_add(&D, &key);
+    }
+    printf("Rehash in progress: ");
+    success_or_failure(D.old_nodes != NULL && D.used_nodes == ui);
+    inaccuraces = 0;
+    for (i = 0; i < ui; i += 2) {
+        item key = make_key(i);
+        if (set_remove(&D, &key) != SET_TRUE) {
+            inaccuraces++;
+        }
+    }
+    while (set_rehash_step(&D, 1024) != SET_TRUE) {
+        continue;
+    }
+    for (i = 0; i < ui + elements; i++) {
+        item key = make_key(i);
+        if ((set_contains(&D, &key) == SET_TRUE) != (i < ui && i % 2 == 1)) {
+            inaccuraces++;
+        }
+    }
+    printf("Keys survive the migration: ");
+    success_or_failure(inaccuraces == 0 && D.old_nodes == NULL && D.used_nodes == ui / 2);
+    set_destroy(&D);
+
+    /* Compare the ways of mapping a hash to its home slot */
+    printf("\n\n==== Index Mode Benchmark ====\n");
+    inaccuraces = time_index_mode("modulo", 0, elements * REHASH_ELEMENTS);
+    inaccuraces += time_index_mode("power of two", SET_POWER_OF_TWO, elements * REHASH_ELEMENTS);
+    inaccuraces += time_index_mode("fastrange", SET_FASTRANGE, elements * REHASH_ELEMENTS);
+    printf("All index modes agree: ");
+    success_or_failure(inaccuraces == 0);
+
+    /*  Benchmark churn: slide a window of keys through the set so that every
+        insert is matched by a removal. Removal cost and probe lengths should
+        stay flat instead of growing with the clusters left behind. */
+    printf("\n\n==== Churn Benchmark ====\n");
+    Timing bench;
+    uint64_t histogram[PROBE_BINS], max_probe;
+    set_clear(&A);
+    initialize_set(&A, 0, elements, 1, SET_TRUE);
+    timing_start(&bench);
+    inaccuraces = 0;
+    for (i = 0; i < elements * CHURN_ROUNDS; i++) {
+        item key = make_key(i);
+        if (set_remove(&A, &key) != SET_TRUE) {
+            inaccuraces++;
+        }
+        key = make_key(i + elements);
+        if (set_add(&A, &key) != SET_TRUE) {
+            inaccuraces++;
+        }
+    }
+    timing_end(&bench);
+    printf("%" PRIu64 " removes and inserts in %f seconds\n", elements * CHURN_ROUNDS, timing_get_difference(bench));
+    max_probe = set_probe_histogram(&A, histogram, PROBE_BINS);
+    printf("Probe lengths (max %" PRIu64 "):", max_probe);
+    for (i = 0; i < PROBE_BINS; i++) {
+        printf(" %" PRIu64, histogram[i]);
+    }
+    printf("\n");
+    printf("Churn keeps the set consistent: ");
+    success_or_failure(inaccuraces == 0 && A.used_nodes == elements);
+
+    /*  Batch insert: a quarter of the batch repeats earlier keys, which must be
+        reported as already present; time it against one set_add per key */
+    printf("\n\n==== Test Batch Insert ====\n");
+    SimpleSet E;
+    uint64_t batch = elements * REHASH_ELEMENTS;
+    item *batch_keys = malloc((batch + batch / 4) * sizeof(item));
+    void **batch_ptrs = malloc((batch + batch / 4) * sizeof(void *));
+    int *batch_results = malloc((batch + batch / 4) * sizeof(int));
+    for (i = 0; i < batch + batch / 4; i++) {
+        batch_keys[i] = make_key(i % batch);
+        batch_ptrs[i] = &batch_keys[i];
+    }
+    set_init(&E, NULL, 1024, item_hash, item_equals, item_copy, item_free);
+    timing_start(&bench);
+    for (i = 0; i < batch + batch / 4; i++) {
+        set_add(&E, batch_ptrs[i]);
+    }
+    timing_end(&bench);
+    printf("%" PRIu64 " single inserts in %f seconds\n", batch + batch / 4, timing_get_difference(bench));
+    set_destroy(&E);
+    set_init(&E, NULL, 1024, item_hash, item_equals, item_copy, item_free);
+    timing_start(&bench);
+    res = set_add_batch(&E, batch_ptrs, NULL, batch + batch / 4, batch_results);
+    timing_end(&bench);
+    printf("%" PRIu64 " batched inserts in %f seconds\n", batch + batch / 4, timing_get_difference(bench));
+    inaccuraces = 0;
+    for (i = 0; i < batch + batch / 4; i++) {
+        if (batch_results[i] != ((i < batch) ? SET_TRUE : SET_ALREADY_PRESENT)) {
+            inaccuraces++;
+        }
+    }
+    for (i = 0; i < batch * 2; i++) {
+        item key = make_key(i);
+        if ((set_contains(&E, &key) == SET_TRUE) != (i < batch)) {
+            inaccuraces++;
+        }
+    }
+    printf("Batch insert results and contents: ");
+    success_or_failure(res == SET_TRUE && inaccuraces == 0 && E.used_nodes == batch);
+    set_destroy(&E);
+    free(batch_keys);
+    free(batch_ptrs);
+    free(batch_results);
+
+    /*  Pipelined lookups against one lookup per key; half of the probed keys
+        are present */
+    printf("\n\n==== Lookup Benchmark ====\n");
+    uint64_t lookups = LOOKUP_ELEMENTS * 2;
+    item *lookup_keys = malloc(lookups * sizeof(item));
+    void **lookup_ptrs = malloc(lookups * sizeof(void *));
+    void **lookup_datas = malloc(lookups * sizeof(void *));
+    int *lookup_results = malloc(lookups * sizeof(int));
+    set_init(&E, NULL, LOOKUP_ELEMENTS, item_hash, item_equals, item_copy, item_free);
+    for (i = 0; i < LOOKUP_ELEMENTS; i++) {
+        item key = make_key(i);
+        set_add_with_data(&E, &key, (void *) (uintptr_t) (i + 1));
+    }
+    srand(1);
+    for (i = 0; i < lookups; i++) {
+        lookup_keys[i] = make_key(((uint64_t) rand() * RAND_MAX + rand()) % lookups);
+        lookup_ptrs[i] = &lookup_keys[i];
+    }
+    inaccuraces = 0;
+    timing_start(&bench);
+    for (i = 0; i < lookups; i++) {
+        inaccuraces += (set_contains(&E, lookup_ptrs[i]) == SET_TRUE);
+    }
+    timing_end(&bench);
+    printf("%" PRIu64 " lookups in a %" PRIu64 " slot set: set_contains %f seconds, ", lookups, E.number_nodes,
+        timing_get_difference(bench));
+    timing_start(&bench);
+    set_contains_many(&E, lookup_ptrs, lookups, lookup_results);
+    timing_end(&bench);
+    printf("set_contains_many %f seconds\n", timing_get_difference(bench));
+    for (i = 0; i < lookups; i++) {
+        if ((lookup_results[i] == SET_TRUE) != (lookup_keys[i] < LOOKUP_ELEMENTS)) {
+            inaccuraces = -1;
+        }
+    }
+    set_get_data_many(&E, lookup_ptrs, lookups, lookup_datas, lookup_results);
+    for (i = 0; i < lookups; i++) {
+        void *expected = (lookup_keys[i] < LOOKUP_ELEMENTS) ? (void *) (uintptr_t) (lookup_keys[i] + 1) : NULL;
+        if (lookup_datas[i] != expected) {
+            inaccuraces = -1;
+        }
+    }
+    printf("Pipelined lookups agree with single lookups: ");
+    success_or_failure(inaccuraces >= 0);
+    set_destroy(&E);
+
+    /*  Walk every key: copying them out with set_to_array (and freeing the
+        copies) against the borrowed iterator and set_foreach */
+    printf("\n\n==== Test Iterators ====\n");
+    uint64_t array_sum = 0, iter_sum = 0, foreach_sum = 0, n_iterated = 0;
+    set_init(&E, NULL, LOOKUP_ELEMENTS, item_hash, item_equals, item_copy, item_free);
+    for (i = 0; i < LOOKUP_ELEMENTS; i++) {
+        item key = make_key(i);
+        set_add_with_data(&E, &key, (void *) (uintptr_t) (i + 1));
+    }
+    timing_start(&bench);
+    item **exported = set_to_array(&E, &ui);
+    for (i = 0; i < ui; i++) {
+        array_sum += *exported[i];
+        free(exported[i]);
+    }
+    free(exported);
+    timing_end(&bench);
+    printf("%" PRIu64 " keys: set_to_array %f seconds, ", ui, timing_get_difference(bench));
+    simple_set_iterator iter;
+    void *iter_key, *iter_data;
+    inaccuraces = 0;
+    timing_start(&bench);
+    set_iter_begin(&E, &iter);
+    while (set_iter_next(&iter, &iter_key, &iter_data) == SET_TRUE) {
+        iter_sum += *(item *) iter_key;
+        n_iterated++;
+        if ((uintptr_t) iter_data != (uintptr_t) *(item *) iter_key + 1) {
+            inaccuraces++;
+        }
+    }
+    timing_end(&bench);
+    printf("set_iter_next %f seconds, ", timing_get_difference(bench));
+    timing_start(&bench);
+    set_foreach(&E, sum_items, &foreach_sum);
+    timing_end(&bench);
+    printf("set_foreach %f seconds\n", timing_get_difference(bench));
+    printf("Iterators visit every key once: ");
+    success_or_failure(inaccuraces == 0 && n_iterated == LOOKUP_ELEMENTS && iter_sum == array_sum && foreach_sum == array_sum);
+    set_destroy(&E);
+
+    /*  The same lookups against a table on transparent huge pages */
+    set_allocator huge_pages;
+    set_huge_page_allocator(&huge_pages);
+    set_init_allocator(&E, NULL, LOOKUP_ELEMENTS, item_hash, item_equals, item_copy, item_free, 0, &huge_pages);
+    for (i = 0; i < LOOKUP_ELEMENTS; i++) {
+        item key = make_key(i);
+        set_add_with_data(&E, &key, (void *) (uintptr_t) (i + 1));
+    }
+    inaccuraces = 0;
+    timing_start(&bench);
+    for (i = 0; i < lookups; i++) {
+        if ((set_contains(&E, lookup_ptrs[i]) == SET_TRUE) != (lookup_keys[i] < LOOKUP_ELEMENTS)) {
+            inaccuraces++;
+        }
+    }
+    timing_end(&bench);
+    printf("%" PRIu64 " lookups on huge pages: set_contains %f seconds\n", lookups, timing_get_difference(bench));
+    printf("Huge page backed set agrees: ");
+    success_or_failure(inaccuraces == 0 && E.used_nodes == LOOKUP_ELEMENTS);
+    set_destroy(&E);
+    free(lookup_keys);
+    free(lookup_ptrs);
+    free(lookup_datas);
+    free(lookup_results);
+
+    /*  Build and tear down a set per frame, copying keys with item_copy and
+        then out of an arena; the arena set removes half the keys and refills
+        them from its free list before each teardown */
+    printf("\n\n==== Arena Benchmark ====\n");
+    timing_start(&bench);
+    for (uint64_t frame = 0; frame < ARENA_FRAMES; frame++) {
+        set_init(&E, NULL, 1024, item_hash, item_equals, item_copy, item_free);
+        for (i = 0; i < elements; i++) {
+            item key = make_key(i);
+            set_add(&E, &key);
+        }
+        set_destroy(&E);
+    }
+    timing_end(&bench);
+    printf("%d frames of %" PRIu64 " keys with item_copy in %f seconds\n", ARENA_FRAMES, elements,
+        timing_get_difference(bench));
+    inaccuraces = 0;
+    timing_start(&bench);
+    for (uint64_t frame = 0; frame < ARENA_FRAMES; frame++) {
+        set_init_arena(&E, NULL, 1024, item_hash, item_equals, sizeof(item), 0);
+        for (i = 0; i < elements; i++) {
+            item key = make_key(i);
+            set_add(&E, &key);
+        }
+        set_destroy(&E);
+    }
+    timing_end(&bench);
+    printf("%d frames of %" PRIu64 " keys in an arena in %f seconds\n", ARENA_FRAMES, elements,
+        timing_get_difference(bench));
+    set_init_arena(&E, NULL, 1024, item_hash, item_equals, sizeof(item), 0);
+    for (uint64_t frame = 0; frame < 2; frame++) {
+        for (i = 0; i < elements; i++) {
+            item key = make_key(i);
+            if (set_add(&E, &key) != SET_TRUE) {
+                inaccuraces++;
+            }
+        }
+        for (i = 0; i < elements; i += 2) {
+            item key = make_key(i);
+            set_remove(&E, &key);
+        }
+        for (i = 0; i < elements; i++) {
+            item key = make_key(i);
+            if (set_add(&E, &key) != ((i % 2 == 0) ? SET_TRUE : SET_ALREADY_PRESENT)) {
+                inaccuraces++;
+            }
+        }
+        set_clear(&E);
+    }
+    item array_key = 42;
+    set_add(&E, &array_key);
+    uint64_t array_size;
+    item **array = set_to_array(&E, &array_size);
+    if (array_size != 1 || *array[0] != 42) {
+        inaccuraces++;
+    }
+    free(array[0]);
+    free(array);
+    printf("Arena sets reuse removed and cleared keys: ");
+    success_or_failure(inaccuraces == 0 && E.used_nodes == 1);
+    set_destroy(&E);
+
+    /*  The hash suite on keys that differ only in their high bits */
+    printf("\n\n==== Hash Benchmark ====\n");
+    hash_benchmark("fnv1a", item_hash);
+    hash_benchmark("murmur3", item_hash_murmur3);
+    hash_benchmark("multiply_xorshift", item_hash_multiply_xorshift);
+    hash_benchmark("wyhash", item_hash_wyhash);
+
+    printf("\n\n==== Test Parallel Set Algebra ====\n");
+    SimpleSet P, Q, serial, parallel;
+    set_init(&P, NULL, PARALLEL_ELEMENTS, item_hash, item_equals, item_copy, item_free);
+    set_init(&Q, NULL, PARALLEL_ELEMENTS, item_hash, item_equals, item_copy, item_free);
+    for (i = 0; i < PARALLEL_ELEMENTS; i++) {
+        item key = make_key(i);
+        set_add(&P, &key);
+        key = make_key(i + PARALLEL_ELEMENTS / 2);
+        set_add(&Q, &key);
+    }
+    Timing serial_time, parallel_time;
+    set_init(&serial, NULL, 1024, item_hash, item_equals, item_copy, item_free);
+    set_init(&parallel, NULL, 1024, item_hash, item_equals, item_copy, item_free);
+    timing_start(&serial_time);
+    set_intersection(&serial, &P, &Q);
+    timing_end(&serial_time);
+    timing_start(&parallel_time);
+    set_intersection_parallel(&parallel, &P, &Q, PARALLEL_THREADS);
+    timing_end(&parallel_time);
+    printf("set_intersection %f seconds, set_intersection_parallel on %d threads %f seconds\n",
+           timing_get_difference(serial_time), PARALLEL_THREADS, timing_get_difference(parallel_time));
+    printf("Parallel intersection matches: ");
+    success_or_failure(set_cmp(&serial, &parallel) == SET_EQUAL && parallel.used_nodes == PARALLEL_ELEMENTS / 2);
+    set_clear(&serial);
+    set_clear(&parallel);
+    timing_start(&serial_time);
+    set_union(&serial, &P, &Q);
+    timing_end(&serial_time);
+    timing_start(&parallel_time);
+    set_union_parallel(&parallel, &P, &Q, PARALLEL_THREADS);
+    timing_end(&parallel_time);
+    printf("set_union %f seconds, set_union_parallel on %d threads %f seconds\n",
+           timing_get_difference(serial_time), PARALLEL_THREADS, timing_get_difference(parallel_time));
+    printf("Parallel union matches: ");
+    success_or_failure(set_cmp_parallel(&serial, &parallel, PARALLEL_THREADS) == SET_EQUAL
+                       && parallel.used_nodes == PARALLEL_ELEMENTS * 3 / 2);
+    set_clear(&serial);
+    set_clear(&parallel);
+    set_difference(&serial, &P, &Q);
+    set_difference_parallel(&parallel, &P, &Q, PARALLEL_THREADS);
+    printf("Parallel difference matches: ");
+    success_or_failure(set_cmp(&serial, &parallel) == SET_EQUAL && parallel.used_nodes == PARALLEL_ELEMENTS / 2);
+    printf("Parallel subset and compare agree with the serial ones: ");
+    success_or_failure(set_is_subset_parallel(&parallel, &P, PARALLEL_THREADS) == SET_TRUE
+                       && set_is_subset_parallel(&parallel, &Q, PARALLEL_THREADS) == SET_FALSE
+                       && set_is_subset_parallel(&P, &Q, PARALLEL_THREADS) == set_is_subset(&P, &Q)
+                       && set_cmp_parallel(&P, &Q, PARALLEL_THREADS) == SET_UNEQUAL);
+    set_destroy(&P);
+    set_destroy(&Q);
+    set_destroy(&serial);
+    set_destroy(&parallel);
+
     printf("\n\n==== Clean Up Memory ====\n");
     set_destroy(&A);
     set_destroy(&B);
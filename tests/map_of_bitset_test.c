@@ -1,9 +1,119 @@
+#include "timing.h"
 #include "../src/map_of_bitset.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <sys/resource.h>
 
+static void sum_labels(uint32_t label, void *context) {
+    *(uint64_t *) context += label;
+}
+
+static void count_keys(map_key key, void *context) {
+    (void) key;
+    (*(uint64_t *) context)++;
+}
+
+#define HASH_GRID 1024
+#define PROBE_BINS 8
+#define CLEAR_FRAMES 1000
+#define CLEAR_KEYS 1000
+
+/*  Fill a HASH_GRID x HASH_GRID grid of 2D keys using the hash called name,
+    look every key up, then print the time taken and the probe lengths */
+static void hash_benchmark(const char *name) {
+    map_key_n_dims n_dims = 2;
+    coordinate_map *map = init_map_hash(&n_dims, 0, name);
+    uint64_t histogram[PROBE_BINS] = {0}, max_probe = 0, found = 0;
+    Timing bench;
+    timing_start(&bench);
+    for (uint32_t x = 0; x < HASH_GRID; x++) {
+        for (uint32_t y = 0; y < HASH_GRID; y++) {
+            add_item(map, make_2d(x, y), (x + y) % MAP_LABEL_BITS);
+        }
+    }
+    for (uint32_t x = 0; x < HASH_GRID; x++) {
+        for (uint32_t y = 0; y < HASH_GRID; y++) {
+            found += coordinate_table_get(&map->table, make_2d(x, y)) != NULL;
+        }
+    }
+    timing_end(&bench);
+    for (uint64_t i = 0; i < map->table.number_nodes; i++) {
+        uint64_t probe = map->table.nodes[i]._dist;
+        if (probe == 0) {
+            continue;
+        }
+        probe--;
+        max_probe = (probe > max_probe) ? probe : max_probe;
+        histogram[(probe < PROBE_BINS) ? probe : PROBE_BINS - 1]++;
+    }
+    printf("%-18s %f seconds, probe lengths (max %" PRIu64 "):", name, timing_get_difference(bench), max_probe);
+    for (int i = 0; i < PROBE_BINS; i++) {
+        printf(" %" PRIu64, histogram[i]);
+    }
+    printf("%s\n", (found == HASH_GRID * HASH_GRID) ? "" : " (lookups disagree!)");
+    destroy_map(map);
+}
+
+#define CONCURRENT_GRID 512
+#define CONCURRENT_THREADS 4
+
+typedef struct {
+    concurrent_coordinate_map *map;
+    uint32_t thread;
+    uint32_t n_threads;
+} ingest_part;
+
+/*  Add every n_threads-th row and column of the grid; key (x, y) is added
+    by the threads of both row x and row y, always with label y */
+static void *ingest_rows(void *arg) {
+    ingest_part *part = arg;
+    for (uint32_t x = part->thread; x < CONCURRENT_GRID; x += part->n_threads) {
+        for (uint32_t y = 0; y < CONCURRENT_GRID; y++) {
+            concurrent_add_item(part->map, make_2d(x, y), y % MAP_LABEL_BITS);
+            concurrent_add_item(part->map, make_2d(y, x), x % MAP_LABEL_BITS);
+        }
+    }
+    return NULL;
+}
+
+/*  Fill a concurrent map from n_threads threads and check every key ended
+    up with just its label; returns the number of wrong keys */
+static uint64_t concurrent_ingest(uint32_t n_threads) {
+    map_key_n_dims n_dims = 2;
+    concurrent_coordinate_map *map = init_concurrent_map(&n_dims, 0, 0);
+    pthread_t threads[CONCURRENT_THREADS];
+    ingest_part parts[CONCURRENT_THREADS];
+    uint64_t wrong = 0;
+    Timing ingest;
+    timing_start(&ingest);
+    for (uint32_t t = 0; t < n_threads; t++) {
+        parts[t].map = map;
+        parts[t].thread = t;
+        parts[t].n_threads = n_threads;
+        pthread_create(&threads[t], NULL, ingest_rows, &parts[t]);
+    }
+    for (uint32_t t = 0; t < n_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    timing_end(&ingest);
+    printf("concurrent_add_item from %u threads in %f seconds\n", n_threads, timing_get_difference(ingest));
+    for (uint32_t x = 0; x < CONCURRENT_GRID; x++) {
+        for (uint32_t y = 0; y < CONCURRENT_GRID; y++) {
+            label_bitset mask = concurrent_get_label_mask(map, make_2d(x, y));
+            uint32_t label = y % MAP_LABEL_BITS;
+            label_bitset want;
+            memset(&want, 0, sizeof(want));
+            want.words[label / 64] = (uint64_t) 1 << (label % 64);
+            wrong += memcmp(&mask, &want, sizeof(mask)) != 0;
+        }
+    }
+    wrong += concurrent_map_length(map) != (uint64_t) CONCURRENT_GRID * CONCURRENT_GRID;
+    destroy_concurrent_map(map);
+    return wrong;
+}
+
 int main() {
     collection key = make_2d(0, 0);
 
@@ -11,29 +121,32 @@ int main() {
     getrusage(RUSAGE_SELF, &usage);
     long usage_start = usage.ru_maxrss;
     map_key_n_dims n_dims_2d = 2;
-    SimpleSet *map2d = init_map(&n_dims_2d, 100);
+    coordinate_map *map2d = init_map(&n_dims_2d, 100);
     getrusage(RUSAGE_SELF, &usage);
     printf("Memory used by map = %ld\n", usage.ru_maxrss - usage_start);
 
     for (int i = 0; i < 100; i++) {
         uint16_t x = rand() & 0xF;
         uint16_t y = rand() & 0xF;
-        uint32_t label = i % 32;
-        update_2d(key, x, y);
+        uint32_t label = (i * 7) % MAP_LABEL_BITS;
+        update_2d(&key, x, y);
         if (!add_item(map2d, key, label)) {
             printf("Not adding %d, %d = %d twice!\n", x, y, label);
         }
     }
+    if (add_item(map2d, key, MAP_LABEL_BITS) != -1) {
+        printf("Label %d should be out of range!\n", MAP_LABEL_BITS);
+    }
     getrusage(RUSAGE_SELF, &usage);
-    printf("Memory used by %ld keys = %ld\n", set_length(map2d), usage.ru_maxrss - usage_start);
+    printf("Memory used by %ld keys = %ld\n", map_length(map2d), usage.ru_maxrss - usage_start);
     free_collection(key);
     uint64_t n_keys;
-    collection **keys_2d = get_keys(map2d, &n_keys);
+    collection *keys_2d = get_keys(map2d, &n_keys);
     uint32_t *labels;
     uint32_t n_labels;
     for (uint64_t i = 0; i < n_keys; i++) {
-        if (get_labels(map2d, *(keys_2d[i]), &labels, &n_labels)) {
-            printf("Labels for (%d, %d): [", keys_2d[i]->index[0], keys_2d[i]->index[1]);
+        if (get_labels(map2d, keys_2d[i], &labels, &n_labels)) {
+            printf("Labels for (%d, %d): [", get_dim(keys_2d[i], 0), get_dim(keys_2d[i], 1));
             for (uint64_t z = 0; z < n_labels; z++) {
                 printf("%d", labels[z]);
                 if (z + 1 < n_labels) {
@@ -41,18 +154,63 @@ int main() {
                 }
             }
             printf("]\n");
+            free(labels);
+        }
+    }
+    for (uint64_t i = 0; i < n_keys; i++) {
+        // the allocation-free variants must agree with each other
+        uint32_t buffer[4];
+        uint32_t n_buffered;
+        uint64_t buffer_sum = 0, visit_sum = 0;
+        get_labels_into(map2d, keys_2d[i], buffer, 4, &n_buffered);
+        for (uint32_t z = 0; z < n_buffered && z < 4; z++) {
+            buffer_sum += buffer[z];
+        }
+        visit_labels(map2d, keys_2d[i], sum_labels, &visit_sum);
+        if (n_buffered <= 4 && buffer_sum != visit_sum) {
+            printf("Label variants disagree for (%d, %d)!\n", get_dim(keys_2d[i], 0), get_dim(keys_2d[i], 1));
+        }
+    }
+    printf("%ld collisions\n", map2d->table.n_collisions);
+
+    // adding the same keys as one batch must rebuild the same key set
+    coordinate_map *batch2d = init_map(&n_dims_2d, 0);
+    uint32_t *batch_labels = calloc(n_keys, sizeof(uint32_t));
+    add_items(batch2d, keys_2d, batch_labels, n_keys, NULL);
+    if (map_length(batch2d) != map_length(map2d)) {
+        printf("Batch added %ld keys instead of %ld!\n", map_length(batch2d), map_length(map2d));
+    }
+    free(batch_labels);
+    destroy_map(batch2d);
+
+    // every stored key is found by the batched lookups
+    int *found = malloc(n_keys * sizeof(int));
+    label_bitset *masks = malloc(n_keys * sizeof(label_bitset));
+    contains_items(map2d, keys_2d, n_keys, found);
+    get_label_masks(map2d, keys_2d, n_keys, masks);
+    for (uint64_t i = 0; i < n_keys; i++) {
+        label_bitset mask = get_label_mask(map2d, keys_2d[i]);
+        if (!found[i] || memcmp(&mask, &masks[i], sizeof(mask)) != 0) {
+            printf("Batched lookup missed (%d, %d)!\n", get_dim(keys_2d[i], 0), get_dim(keys_2d[i], 1));
         }
     }
-    printf("%ld collisions\n", map2d->n_collisions);
+    free(found);
+    free(masks);
+    uint64_t n_visited = 0;
+    visit_keys(map2d, count_keys, &n_visited);
+    if (n_visited != n_keys) {
+        printf("visit_keys saw %ld keys instead of %ld!\n", n_visited, n_keys);
+    }
+    free(keys_2d);
 
     map_key_n_dims n_dims_3d = 3;
-    SimpleSet *map3d = init_map(&n_dims_3d, 1000);
+    coordinate_map *map3d = init_map(&n_dims_3d, 1000);
     for (int i = 0; i < 1000; i++) {
         uint16_t x = rand() & 0xF;
         uint16_t y = rand() & 0xF;
         uint16_t z = rand() & 0xF;
         collection key = make_3d(x, y, z);
-        uint32_t label = i % 32;
+        uint32_t label = (i * 7) % MAP_LABEL_BITS;
         if (!add_item(map3d, key, label)) {
             printf("Not adding %d, %d, %d = %d twice!\n", x, y, z, label);
         }
@@ -71,9 +229,58 @@ int main() {
                         }
                     }
                     printf("]\n");
+                    free(labels);
                 }
             }
         }
     }
-    printf("%ld collisions\n", map3d->n_collisions);
+    printf("%ld collisions\n", map3d->table.n_collisions);
+    destroy_map(map2d);
+    destroy_map(map3d);
+
+    if (init_map_hash(&n_dims_2d, 0, "no_such_hash") != NULL) {
+        printf("Unknown hash names should be rejected!\n");
+    }
+    printf("\nHashing a %d x %d grid of keys\n", HASH_GRID, HASH_GRID);
+    hash_benchmark("fnv1a");
+    hash_benchmark("murmur3");
+    hash_benchmark("multiply_xorshift");
+    hash_benchmark("coordinates");
+
+    printf("\nReusing a map for %d frames of %d keys\n", CLEAR_FRAMES, CLEAR_KEYS);
+    coordinate_map *frame_map = init_map(&n_dims_2d, HASH_GRID * HASH_GRID);
+    uint64_t stale = 0;
+    Timing frames;
+    timing_start(&frames);
+    for (uint32_t f = 0; f < CLEAR_FRAMES; f++) {
+        clear_map(frame_map);
+        for (uint32_t i = 0; i < CLEAR_KEYS; i++) {
+            add_item(frame_map, make_2d(f, i), f % MAP_LABEL_BITS);
+        }
+        // last frame's keys must be gone, this frame's present
+        stale += (coordinate_table_get(&frame_map->table, make_2d(f - 1, 0)) != NULL)
+               + (coordinate_table_get(&frame_map->table, make_2d(f, 0)) == NULL);
+    }
+    timing_end(&frames);
+    printf("clear_map and refill in %f seconds\n", timing_get_difference(frames));
+    if (stale != 0 || map_length(frame_map) != CLEAR_KEYS) {
+        printf("clear_map left stale keys behind!\n");
+    }
+    destroy_map(frame_map);
+
+    coordinate_map *left = init_map(&n_dims_2d, 0), *right = init_map(&n_dims_2d, 0);
+    for (uint16_t i = 0; i < 100; i++) {
+        add_item(left, make_2d(7, i), 1);
+        add_item(right, make_2d(7, i + 50), 2);
+    }
+    if (map_intersection_count(left, right) != 50 || map_union_count(left, right) != 150
+            || map_difference_count(left, right) != 50 || map_difference_count(right, left) != 50) {
+        printf("Key counts across maps are wrong!\n");
+    }
+    destroy_map(left);
+    destroy_map(right);
+
+    if (concurrent_ingest(1) != 0 || concurrent_ingest(CONCURRENT_THREADS) != 0) {
+        printf("Concurrent map lost or mixed up labels!\n");
+    }
 }
@@ -2,10 +2,79 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+
+static void sum_labels(uint32_t label, void *context) {
+    *(uint64_t *) context += label;
+}
+
+static void count_keys(map_key key, void *context) {
+    (void) key;
+    (*(uint64_t *) context)++;
+}
+
+static void free_labels(uint32_t **labels, uint64_t n_labels) {
+    for (uint64_t i = 0; i < n_labels; i++) {
+        free(labels[i]);
+    }
+    free(labels);
+}
+
+#define CONCURRENT_GRID 512
+#define CONCURRENT_THREADS 4
+
+typedef struct {
+    concurrent_coordinate_map *map;
+    uint32_t thread;
+    uint32_t n_threads;
+} ingest_part;
+
+/*  Add every n_threads-th row and column of the grid; key (x, y) is added
+    by the threads of both row x and row y, always with label y */
+static void *ingest_rows(void *arg) {
+    ingest_part *part = arg;
+    for (uint32_t x = part->thread; x < CONCURRENT_GRID; x += part->n_threads) {
+        for (uint32_t y = 0; y < CONCURRENT_GRID; y++) {
+            concurrent_add_item(part->map, make_2d(x, y), y);
+            concurrent_add_item(part->map, make_2d(y, x), x);
+        }
+    }
+    return NULL;
+}
+
+/*  Fill a concurrent map from n_threads threads and check every key ended
+    up with just its label; returns the number of wrong keys */
+static uint64_t concurrent_ingest(uint32_t n_threads) {
+    map_key_n_dims n_dims = 2;
+    concurrent_coordinate_map *map = init_concurrent_map(&n_dims, 0, 0);
+    pthread_t threads[CONCURRENT_THREADS];
+    ingest_part parts[CONCURRENT_THREADS];
+    uint64_t wrong = 0;
+    for (uint32_t t = 0; t < n_threads; t++) {
+        parts[t].map = map;
+        parts[t].thread = t;
+        parts[t].n_threads = n_threads;
+        pthread_create(&threads[t], NULL, ingest_rows, &parts[t]);
+    }
+    for (uint32_t t = 0; t < n_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (uint32_t x = 0; x < CONCURRENT_GRID; x++) {
+        for (uint32_t y = 0; y < CONCURRENT_GRID; y++) {
+            uint32_t labels[2];
+            uint64_t n_labels = 0;
+            int found = concurrent_get_labels_into(map, make_2d(x, y), labels, 2, &n_labels);
+            wrong += !found || n_labels != 1 || labels[0] != y;
+        }
+    }
+    wrong += concurrent_map_length(map) != (uint64_t) CONCURRENT_GRID * CONCURRENT_GRID;
+    destroy_concurrent_map(map);
+    return wrong;
+}
 
 int main() {
     map_key_n_dims n_dims_2d = 2;
-    SimpleSet *map2d = init_map(&n_dims_2d, 100);
+    coordinate_map *map2d = init_map(&n_dims_2d, 100);
     for (uint32_t i = 0; i < 100; i++) {
         uint16_t x = rand() & 0xF;
         uint16_t y = rand() & 0xF;
@@ -17,12 +86,12 @@ int main() {
         free_collection(key);
     }
     uint64_t n_keys;
-    collection **keys = get_keys(map2d, &n_keys);
+    collection *keys = get_keys(map2d, &n_keys);
     uint32_t **labels;
     uint64_t n_labels;
     for (uint32_t i = 0; i < n_keys; i++) {
-        if (get_labels(map2d, *(keys[i]), &labels, &n_labels)) {
-            printf("Labels for (%d, %d): [", keys[i]->index[0], keys[i]->index[1]);
+        if (get_labels(map2d, keys[i], &labels, &n_labels)) {
+            printf("Labels for (%d, %d): [", get_dim(keys[i], 0), get_dim(keys[i], 1));
             for (uint64_t j = 0; j < n_labels; j++) {
                 printf("%d", *labels[j]);
                 if (j + 1 < n_labels) {
@@ -30,11 +99,26 @@ int main() {
                 }
             }
             printf("]\n");
+            free_labels(labels, n_labels);
+        }
+    }
+    for (uint64_t i = 0; i < n_keys; i++) {
+        // the allocation-free variants must agree with each other
+        uint32_t buffer[4];
+        uint64_t n_buffered;
+        uint64_t buffer_sum = 0, visit_sum = 0;
+        get_labels_into(map2d, keys[i], buffer, 4, &n_buffered);
+        for (uint64_t z = 0; z < n_buffered && z < 4; z++) {
+            buffer_sum += buffer[z];
+        }
+        visit_labels(map2d, keys[i], sum_labels, &visit_sum);
+        if (n_buffered <= 4 && buffer_sum != visit_sum) {
+            printf("Label variants disagree for (%d, %d)!\n", get_dim(keys[i], 0), get_dim(keys[i], 1));
         }
     }
 
     map_key_n_dims n_dims_3d = 3;
-    SimpleSet *map3d = init_map(&n_dims_3d, 1000);
+    coordinate_map *map3d = init_map(&n_dims_3d, 1000);
     for (uint32_t i = 0; i < 1000; i++) {
         uint16_t x = rand() & 0xF;
         uint16_t y = rand() & 0xF;
@@ -59,8 +143,62 @@ int main() {
                         }
                     }
                     printf("]\n");
+                    free_labels(labels, n_labels);
                 }
             }
         }
     }
+
+    // push one key past the inline labels into a label table
+    collection busy = make_3d(0x10, 0x10, 0x10);
+    uint32_t busy_labels[3 * MAP_INLINE_LABELS];
+    uint64_t n_busy;
+    for (uint32_t i = 0; i < 3 * MAP_INLINE_LABELS; i++) {
+        add_item(map3d, busy, 3 * MAP_INLINE_LABELS - i);
+        if (add_item(map3d, busy, 3 * MAP_INLINE_LABELS - i) != 0) {
+            printf("Added label %d twice!\n", 3 * MAP_INLINE_LABELS - i);
+        }
+    }
+    uint64_t busy_sum = 0, visit_sum = 0;
+    get_labels_into(map3d, busy, busy_labels, 3 * MAP_INLINE_LABELS, &n_busy);
+    for (uint64_t i = 0; i < n_busy; i++) {
+        busy_sum += busy_labels[i];
+    }
+    visit_labels(map3d, busy, sum_labels, &visit_sum);
+    if (n_busy != 3 * MAP_INLINE_LABELS || busy_sum != visit_sum) {
+        printf("Expected %d labels, found %ld!\n", 3 * MAP_INLINE_LABELS, n_busy);
+    }
+    // every stored key is found by the batched lookups
+    const label_list **lists = malloc(n_keys * sizeof(label_list *));
+    get_label_lists(map2d, keys, n_keys, lists);
+    for (uint64_t i = 0; i < n_keys; i++) {
+        if (lists[i] != get_label_list(map2d, keys[i]) || lists[i] == NULL) {
+            printf("Batched lookup missed (%d, %d)!\n", get_dim(keys[i], 0), get_dim(keys[i], 1));
+        }
+    }
+    free(lists);
+    uint64_t n_visited = 0;
+    visit_keys(map2d, count_keys, &n_visited);
+    if (n_visited != n_keys) {
+        printf("visit_keys saw %ld keys instead of %ld!\n", n_visited, n_keys);
+    }
+    free(keys);
+    destroy_map(map2d);
+    destroy_map(map3d);
+
+    coordinate_map *left = init_map(&n_dims_2d, 0), *right = init_map(&n_dims_2d, 0);
+    for (uint16_t i = 0; i < 100; i++) {
+        add_item(left, make_2d(7, i), 1);
+        add_item(right, make_2d(7, i + 50), 2);
+    }
+    if (map_intersection_count(left, right) != 50 || map_union_count(left, right) != 150
+            || map_difference_count(left, right) != 50 || map_difference_count(right, left) != 50) {
+        printf("Key counts across maps are wrong!\n");
+    }
+    destroy_map(left);
+    destroy_map(right);
+
+    if (concurrent_ingest(1) != 0 || concurrent_ingest(CONCURRENT_THREADS) != 0) {
+        printf("Concurrent map lost or mixed up labels!\n");
+    }
 }
@@ -45,6 +45,29 @@ void free_key(item key) {
     free(key.index);
 }
 
+/* allocator that keeps a count of the bytes it has outstanding */
+static void *counting_alloc(uint64_t size, void *context) {
+    *(uint64_t *) context += size;
+    return calloc(1, size);
+}
+
+static void counting_free(void *ptr, uint64_t size, void *context) {
+    *(uint64_t *) context -= size;
+    free(ptr);
+}
+
+/* counting_alloc, except that key copies (smaller than a node) fail */
+static void *no_keys_alloc(uint64_t size, void *context) {
+    if (size < sizeof(simple_set_node)) {
+        return NULL;
+    }
+    return counting_alloc(size, context);
+}
+
+static void count_labels(const item *key, void *context) {
+    *(uint64_t *) context += key->label;
+}
+
 void initialize_set(SimpleSet *set, int start, int elements, int itter, int TEST) {
     int i;
     for (i = start; i < elements; i+=itter) {
@@ -57,6 +80,26 @@ void initialize_set(SimpleSet *set, int start, int elements, int itter, int TEST
     }
 }
 
+typedef int (*in_place_op)(SimpleSet *dest, SimpleSet *other);
+typedef int (*set_op)(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
+
+/*  Run update(dest, other) on dest = [d_start, d_end) and other =
+    [o_start, o_end); 1 if dest ends up equal to op(dest, other) */
+static int check_in_place(in_place_op update, set_op op, int d_start, int d_end, int o_start, int o_end) {
+    SimpleSet dest, other, expected;
+    set_init(&dest);
+    set_init(&other);
+    set_init(&expected);
+    initialize_set(&dest, d_start, d_end, 1, SET_TRUE);
+    initialize_set(&other, o_start, o_end, 1, SET_TRUE);
+    op(&expected, &dest, &other);
+    int res = update(&dest, &other) == SET_TRUE && set_cmp(&dest, &expected) == SET_EQUAL;
+    set_destroy(&dest);
+    set_destroy(&other);
+    set_destroy(&expected);
+    return res;
+}
+
 int main() {
     Timing t;
     timing_start(&t);
@@ -118,6 +161,7 @@ int main() {
             printf("Missing Key: [%d]\n", key.label);
             inaccuraces++;
         }
+        free_key(key);
     }
     success_or_failure(inaccuraces == 0);
 
@@ -413,6 +457,157 @@ int main() {
     res = set_cmp(&A, &B);
     success_or_failure(res == SET_UNEQUAL);
 
+    printf("\n\n==== Test In Place Set Algebra ====\n");
+    printf("set_union_into matches set_union: ");
+    success_or_failure(check_in_place(set_union_into, set_union, 0, 1000, 500, 5000));
+    printf("set_intersect_update matches set_intersection (smaller dest): ");
+    success_or_failure(check_in_place(set_intersect_update, set_intersection, 0, 1000, 500, 5000));
+    printf("set_intersect_update matches set_intersection (smaller other): ");
+    success_or_failure(check_in_place(set_intersect_update, set_intersection, 0, 5000, 4500, 5500));
+    printf("set_difference_update matches set_difference (smaller dest): ");
+    success_or_failure(check_in_place(set_difference_update, set_difference, 0, 1000, 500, 5000));
+    printf("set_difference_update matches set_difference (smaller other): ");
+    success_or_failure(check_in_place(set_difference_update, set_difference, 0, 5000, 4500, 5500));
+    printf("set_symmetric_difference_update matches set_symmetric_difference: ");
+    success_or_failure(check_in_place(set_symmetric_difference_update, set_symmetric_difference, 0, 1000, 500, 5000));
+    printf("set_difference_update of a set with itself empties it: ");
+    set_clear(&C);
+    set_union_into(&C, &A);
+    success_or_failure(set_difference_update(&C, &C) == SET_TRUE && C.used_nodes == 0);
+
+    printf("\n\n==== Test Skewed Set Algebra ====\n");
+    SimpleSet Big, Small, Left, Right;
+    set_init(&Big);
+    set_init(&Small);
+    set_init(&Left);
+    set_init(&Right);
+    initialize_set(&Big, 0, elements, 1, SET_TRUE);
+    initialize_set(&Small, elements - 10, elements + 10, 1, SET_TRUE);
+    set_intersection(&Left, &Big, &Small);
+    set_intersection(&Right, &Small, &Big);
+    printf("Intersection is the same whichever set is smaller: ");
+    success_or_failure(Left.used_nodes == 10 && set_cmp(&Left, &Right) == SET_EQUAL);
+    printf("A larger set is never a subset: ");
+    success_or_failure(set_is_subset(&Big, &Small) == SET_FALSE && set_is_superset(&Small, &Big) == SET_FALSE);
+    set_clear(&Left);
+    ui = Left.number_nodes;
+    set_reserve(&Left, elements);
+    res = (Left.number_nodes != ui);
+    ui = Left.number_nodes;
+    initialize_set(&Left, 0, elements, 1, SET_TRUE);
+    printf("set_reserve makes room for every key up front: ");
+    success_or_failure(res && Left.number_nodes == ui);
+
+    printf("\n\n==== Test Count Only Set Algebra ====\n");
+    printf("set_intersection_count matches set_intersection: ");
+    success_or_failure(set_intersection_count(&Big, &Small) == Right.used_nodes
+                       && set_intersection_count(&A, &B) == elements - 1);
+    printf("set_union_count counts shared keys once: ");
+    success_or_failure(set_union_count(&A, &B) == elements + 1 && set_union_count(&Small, &Big) == elements + 10);
+    printf("set_difference_count counts keys only in the first set: ");
+    success_or_failure(set_difference_count(&A, &B) == 1 && set_difference_count(&Small, &Big) == 10
+                       && set_difference_count(&Big, &Small) == elements - 10);
+    set_destroy(&Big);
+    set_destroy(&Small);
+    set_destroy(&Left);
+    set_destroy(&Right);
+
+    printf("\n\n==== Test Set Iterators ====\n");
+    uint64_t iter_sum = 0, foreach_sum = 0, n_iterated = 0;
+    simple_set_iterator iter;
+    const item *iter_key;
+    set_iter_begin(&A, &iter);
+    while (set_iter_next(&iter, &iter_key) == SET_TRUE) {
+        iter_sum += iter_key->label;
+        n_iterated++;
+    }
+    set_foreach(&A, count_labels, &foreach_sum);
+    printf("Iterators visit every key once: ");
+    success_or_failure(n_iterated == A.used_nodes && iter_sum == foreach_sum);
+
+    printf("\n\n==== Test Set Hash By Name ====\n");
+    printf("Unknown hash names are rejected: ");
+    success_or_failure(set_hash_by_name("no_such_hash") == NULL);
+    SimpleSet F;
+    set_init_alt(&F, set_hash_by_name("fnv1a"));
+    initialize_set(&F, 0, elements, 1, SET_TRUE);
+    printf("A set hashed with fnv1a holds the same keys: ");
+    success_or_failure(set_cmp(&F, &A) == SET_EQUAL);
+    printf("Set algebra between sets with different hashes: ");
+    SimpleSet Mixed, G;
+    set_init(&Mixed);
+    res = set_intersection(&Mixed, &F, &A) == SET_TRUE && Mixed.used_nodes == elements
+          && set_is_subset(&F, &A) == SET_TRUE && set_is_subset(&A, &F) == SET_TRUE;
+    set_clear(&Mixed);
+    res = res && set_difference(&Mixed, &F, &A) == SET_TRUE && Mixed.used_nodes == 0;
+    set_clear(&Mixed);
+    res = res && set_symmetric_difference(&Mixed, &A, &F) == SET_TRUE && Mixed.used_nodes == 0;
+    set_clear(&Mixed);
+    res = res && set_union(&Mixed, &A, &F) == SET_TRUE && set_cmp(&Mixed, &A) == SET_EQUAL;
+    success_or_failure(res);
+    printf("In place set algebra between sets with different hashes: ");
+    set_clear(&Mixed);
+    initialize_set(&Mixed, 0, 1000, 1, SET_TRUE);
+    set_init_alt(&G, set_hash_by_name("fnv1a"));
+    initialize_set(&G, 500, 5000, 1, SET_TRUE);
+    item probe = make_key(4000);
+    res = set_union_into(&G, &Mixed) == SET_TRUE && set_length(&G) == 5000
+          && set_intersect_update(&G, &Mixed) == SET_TRUE && set_cmp(&G, &Mixed) == SET_EQUAL
+          && set_symmetric_difference_update(&G, &A) == SET_TRUE && set_length(&G) == elements - 1000
+          && set_contains(&G, probe) == SET_TRUE
+          && set_union_into(&Mixed, &G) == SET_TRUE && set_cmp(&Mixed, &A) == SET_EQUAL
+          && set_difference_update(&G, &Mixed) == SET_TRUE && set_length(&G) == 0;
+    initialize_set(&G, 0, 10, 1, SET_TRUE);
+    initialize_set(&G, elements - 10, elements, 1, SET_TRUE);
+    res = res && set_intersect_update(&G, &Mixed) == SET_TRUE && set_length(&G) == 20
+          && set_difference_update(&Mixed, &G) == SET_TRUE && set_length(&Mixed) == elements - 20
+          && set_contains(&Mixed, probe) == SET_TRUE;
+    success_or_failure(res);
+    printf("Set counts between sets with different hashes: ");
+    success_or_failure(set_intersection_count(&F, &A) == elements && set_intersection_count(&G, &Mixed) == 0
+                       && set_union_count(&Mixed, &F) == elements && set_difference_count(&F, &G) == elements - 20);
+    free_key(probe);
+    set_destroy(&G);
+    set_destroy(&Mixed);
+    set_destroy(&F);
+
+    printf("\n\n==== Test Set Allocator ====\n");
+    uint64_t outstanding = 0;
+    set_allocator counting = { counting_alloc, counting_free, &outstanding };
+    SimpleSet D;
+    set_init_allocator(&D, NULL, &counting);
+    initialize_set(&D, 0, elements, 1, SET_TRUE);
+    for (i = 0; i < elements; i += 2) {
+        item key = make_key(i);
+        set_remove(&D, key);
+        free_key(key);
+    }
+    printf("Allocator sees the table, nodes and keys: ");
+    success_or_failure(outstanding > D.number_nodes * sizeof(simple_set_node*));
+    n_iterated = 0;
+    set_iter_begin(&D, &iter);
+    while (set_iter_next(&iter, &iter_key) == SET_TRUE) {
+        n_iterated++;
+    }
+    printf("Iterating after removals sees only the remaining keys: ");
+    success_or_failure(n_iterated == D.used_nodes && n_iterated == elements / 2);
+    set_clear(&D);
+    set_iter_begin(&D, &iter);
+    printf("Nothing is left to iterate after set_clear: ");
+    success_or_failure(set_iter_next(&iter, &iter_key) == SET_FALSE && D.used_nodes == 0);
+    set_destroy(&D);
+    printf("Every allocation is returned on destroy: ");
+    success_or_failure(outstanding == 0);
+    set_allocator no_keys = { no_keys_alloc, counting_free, &outstanding };
+    set_init_allocator(&D, NULL, &no_keys);
+    uint64_t table_bytes = outstanding;
+    item failing_key = make_key(1);
+    printf("A failed key copy is reported and leaves nothing behind: ");
+    success_or_failure(set_add(&D, failing_key) == SET_MALLOC_ERROR && D.used_nodes == 0
+                       && outstanding == table_bytes);
+    free_key(failing_key);
+    set_destroy(&D);
+
     printf("\n\n==== Clean Up Memory ====\n");
     set_destroy(&A);
     set_destroy(&B);